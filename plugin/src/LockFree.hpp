@@ -0,0 +1,92 @@
+#pragma once
+// Lock-free handoff between one audio thread and one other thread (the
+// UI, or a control loop on the firmware). Neither side ever blocks, and
+// the audio side never allocates.
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Bounded single-producer/single-consumer queue. One thread pushes, one
+// other thread pops; items are copied in and out of a fixed ring.
+template <class T, int CAPACITY>
+struct SpscQueue {
+    static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "capacity must be a power of two");
+
+    T items[CAPACITY];
+    // Free-running counters, each written by one side only and kept on
+    // separate cache lines so the two sides do not contend
+    alignas(64) std::atomic<uint32_t> head{0};  // next item to pop
+    alignas(64) std::atomic<uint32_t> tail{0};  // next slot to push
+
+    // Producer side. Returns false if the queue is full.
+    bool push(const T& item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) >= (uint32_t)CAPACITY)
+            return false;
+        items[t % CAPACITY] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false if the queue is empty.
+    bool pop(T& item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        item = items[h % CAPACITY];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side, a single relaxed load for the common empty case
+    bool empty() const {
+        return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_relaxed);
+    }
+};
+
+// Value published by one writer and read by any number of readers. The
+// writer never waits; a reader retries if a write overlapped its copy, so
+// it always gets one whole published value. The value is held as atomic
+// words so the overlapping copy is not a data race.
+template <class T>
+struct Seqlock {
+    static_assert(std::is_trivially_copyable<T>::value, "published values are copied as raw words");
+    static const int WORDS = (sizeof(T) + 3) / 4;
+
+    std::atomic<uint32_t> sequence{0};
+    std::atomic<uint32_t> words[WORDS];
+
+    Seqlock() {
+        write(T());
+    }
+
+    void write(const T& value) {
+        uint32_t buffer[WORDS] = {0};
+        std::memcpy(buffer, &value, sizeof(T));
+        uint32_t s = sequence.load(std::memory_order_relaxed);
+        // Odd while the words are being written
+        sequence.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (int i = 0; i < WORDS; i++) {
+            words[i].store(buffer[i], std::memory_order_relaxed);
+        }
+        sequence.store(s + 2, std::memory_order_release);
+    }
+
+    T read() const {
+        uint32_t buffer[WORDS];
+        uint32_t before, after;
+        do {
+            before = sequence.load(std::memory_order_acquire);
+            for (int i = 0; i < WORDS; i++) {
+                buffer[i] = words[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = sequence.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+        T value;
+        std::memcpy(&value, buffer, sizeof(T));
+        return value;
+    }
+};
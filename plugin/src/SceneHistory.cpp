@@ -0,0 +1,55 @@
+#include "SceneHistory.hpp"
+#include <algorithm>
+#include <utility>
+
+template <int TRACKS, int STEPS>
+void SceneHistoryT<TRACKS, STEPS>::record(int scene, uint32_t key, const SceneData& data) {
+    if (key != 0 && key == lastKey && undoCount > 0 && redoCount == 0)
+        return;
+    Level& level = levels[head];
+    level.scene = scene;
+    level.data = data;
+    head = (head + 1) % LEVELS;
+    undoCount = std::min(undoCount + 1, LEVELS);
+    redoCount = 0;
+    lastKey = key;
+}
+
+template <int TRACKS, int STEPS>
+int SceneHistoryT<TRACKS, STEPS>::undo(SceneData* scenes) {
+    if (undoCount == 0)
+        return -1;
+    head = (head + LEVELS - 1) % LEVELS;
+    Level& level = levels[head];
+    std::swap(scenes[level.scene], level.data);
+    undoCount--;
+    redoCount++;
+    lastKey = 0;
+    return level.scene;
+}
+
+template <int TRACKS, int STEPS>
+int SceneHistoryT<TRACKS, STEPS>::redo(SceneData* scenes) {
+    if (redoCount == 0)
+        return -1;
+    Level& level = levels[head];
+    std::swap(scenes[level.scene], level.data);
+    head = (head + 1) % LEVELS;
+    redoCount--;
+    undoCount++;
+    lastKey = 0;
+    return level.scene;
+}
+
+template <int TRACKS, int STEPS>
+void SceneHistoryT<TRACKS, STEPS>::clear() {
+    head = 0;
+    undoCount = 0;
+    redoCount = 0;
+    lastKey = 0;
+}
+
+// Engine sizes in use, see SequencerCore.hpp
+template struct SceneHistoryT<3, 8>;
+template struct SceneHistoryT<4, 16>;
+template struct SceneHistoryT<8, 64>;
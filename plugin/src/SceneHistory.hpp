@@ -0,0 +1,45 @@
+#pragma once
+// Undo/redo history of scene edits, preallocated so recording and
+// restoring never allocate and can run on the audio thread.
+//
+// Each level holds one scene as it was on the other side of an edit. Undo
+// swaps that copy with the live scene, which leaves the edited version in
+// the level for redo, so both take the same constant time whatever the
+// edit was. Repeated edits with the same key (one knob turned through
+// many values) share one level.
+#include "SequencerCore.hpp"
+
+template <int TRACKS, int STEPS>
+struct SceneHistoryT {
+    typedef SceneDataT<TRACKS, STEPS> SceneData;
+
+    static const int LEVELS = 256;
+
+    struct Level {
+        int scene = 0;
+        SceneData data;
+    };
+    Level levels[LEVELS];
+    // Slot the next recorded level goes to
+    int head = 0;
+    int undoCount = 0;
+    int redoCount = 0;
+    // Key of the last recorded edit, 0 if it cannot be merged into
+    uint32_t lastKey = 0;
+
+    // Records `data`, the state of `scene` before an edit, unless it
+    // continues the previous edit (same non-zero key). Drops any redo levels.
+    void record(int scene, uint32_t key, const SceneData& data);
+    // Step back or forward one level in `scenes`. Return the scene that
+    // changed, or -1 if there is nothing to undo or redo.
+    int undo(SceneData* scenes);
+    int redo(SceneData* scenes);
+    // Ends the current edit, so the next one gets its own level
+    void close() {
+        lastKey = 0;
+    }
+    void clear();
+};
+
+template <int TRACKS, int STEPS>
+const int SceneHistoryT<TRACKS, STEPS>::LEVELS;
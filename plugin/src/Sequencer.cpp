@@ -1,47 +1,27 @@
 #include "plugin.hpp"
-
-// Constants
-static const int NUM_TRACKS = 3;
-static const int NUM_STEPS = 8;
-static const int NUM_SCENES = 8;
-
-// Clock division ratios - musical note values (assuming clock = quarter note)
-static const float DIVISIONS[] = {
-    4.0f,           // 1/1  (whole note) - 4 clocks per step
-    2.0f,           // 1/2  (half note) - 2 clocks per step
-    1.0f,           // 1/4  (quarter note) - 1 clock per step
-    0.5f,           // 1/8  (eighth note) - 2 steps per clock
-    1.0f / 3.0f,    // 1/8T (eighth triplet) - 3 steps per clock
-    0.25f,          // 1/16 (sixteenth note) - 4 steps per clock
-    1.0f / 6.0f,    // 1/16T (sixteenth triplet) - 6 steps per clock
-    0.125f          // 1/32 (thirty-second note) - 8 steps per clock
-};
-static const int NUM_DIVISIONS = 8;
-
-// Direction modes
-enum Direction {
-    DIR_FORWARD,
-    DIR_REVERSE,
-    DIR_PENDULUM,
-    DIR_RANDOM
-};
-
-// Track data structure
-struct TrackData {
-    int stepCount = 8;
-    int divisionIndex = 2;  // Default 1/4
-    Direction direction = DIR_FORWARD;
-    float pitches[NUM_STEPS] = {0.f};
-    bool gates[NUM_STEPS] = {true, true, true, true, true, true, true, true};
-};
-
-// Scene stores complete state of all tracks
-struct SceneData {
-    TrackData tracks[NUM_TRACKS];
-    bool isEmpty = true;
-};
-
-struct Sequencer : Module {
+#include "SequencerCore.hpp"
+#include "SequencerJson.hpp"
+#include "SceneHistory.hpp"
+#include "LockFree.hpp"
+
+// Panel size, fixed by the engine size this module uses
+static const int NUM_TRACKS = SequencerCore::NUM_TRACKS;
+static const int NUM_STEPS = SequencerCore::NUM_STEPS;
+static const int NUM_SCENES = SequencerCore::NUM_SCENES;
+typedef SequencerCore::TrackData TrackData;
+typedef SequencerCore::SceneData SceneData;
+
+// Everything below loops over the engine size, but the panel artwork
+// (res/Sequencer.svg) and the control positions are drawn for 3x8x8
+static_assert(NUM_TRACKS == 3 && NUM_STEPS == 8 && NUM_SCENES == 8, "the panel is laid out for 3 tracks, 8 steps and 8 scenes");
+
+// External clock smoothing settings, 0 hard-syncs to every clock edge
+static const float CLOCK_SMOOTHINGS[] = {0.f, 0.5f, 0.75f, 0.9f};
+static const int NUM_CLOCK_SMOOTHINGS = 4;
+// Index of DEFAULT_CLOCK_SMOOTHING, the engine's own default
+static const int DEFAULT_CLOCK_SMOOTHING_INDEX = 1;
+
+struct Sequencer : Module, CacheAligned {
     enum ParamId {
         // Internal clock controls
         BPM_PARAM,
@@ -76,13 +56,12 @@ struct Sequencer : Module {
     enum OutputId {
         CLOCK_OUTPUT,
         RESET_OUTPUT,
-        TRACK1_PITCH_OUTPUT,
-        TRACK1_GATE_OUTPUT,
-        TRACK2_PITCH_OUTPUT,
-        TRACK2_GATE_OUTPUT,
-        TRACK3_PITCH_OUTPUT,
-        TRACK3_GATE_OUTPUT,
+        // Pitch and gate of each track, interleaved, see pitchOutput()
+        ENUMS(TRACK_OUTPUTS, NUM_TRACKS * 2),
         SCENE_CV_OUTPUT,
+        // All tracks as channels of one poly cable
+        POLY_PITCH_OUTPUT,
+        POLY_GATE_OUTPUT,
         OUTPUTS_LEN
     };
     enum LightId {
@@ -101,61 +80,87 @@ struct Sequencer : Module {
         LIGHTS_LEN
     };
 
-    // Scene and track state
-    SceneData scenes[NUM_SCENES];
-    int currentScene = 0;
-    int selectedTrack = 0;  // Which track the encoders control (0-2)
-    int copySourceScene = -1;
-    bool deleteMode = false;
+    // Track output ids, in the order of the original per-track outputs so
+    // saved cables keep their ports
+    static int pitchOutput(int t) {
+        return TRACK_OUTPUTS + 2 * t;
+    }
+    static int gateOutput(int t) {
+        return TRACK_OUTPUTS + 2 * t + 1;
+    }
+
+    SequencerCore core;
 
-    // Per-track playback state
-    int currentStep[NUM_TRACKS] = {0, 0, 0};
-    int pendulumDir[NUM_TRACKS] = {1, 1, 1};
-    float clockPhase[NUM_TRACKS] = {0.f, 0.f, 0.f};
+    // UI state
+    int selectedTrack = 0;  // Which track the encoders control
 
     // Triggers
-    dsp::SchmittTrigger clockTrigger;
-    dsp::SchmittTrigger resetTrigger;
     dsp::SchmittTrigger sceneTriggers[NUM_SCENES];
     dsp::SchmittTrigger trackSelectTriggers[NUM_TRACKS];
     dsp::SchmittTrigger copyTrigger;
     dsp::SchmittTrigger deleteTrigger;
-    dsp::SchmittTrigger gateTriggers[NUM_TRACKS * NUM_STEPS];
     dsp::SchmittTrigger runTrigger;
     dsp::SchmittTrigger rstButtonTrigger;
 
-    // Gate pulse generators
-    dsp::PulseGenerator gatePulse[NUM_TRACKS];
-    dsp::PulseGenerator clockOutputPulse;
-    dsp::PulseGenerator resetOutputPulse;
-
-    // Internal clock state
-    float internalClockPhase = 0.f;
-    bool isRunning = true;
-
-    // Clock period tracking
-    float lastClockRiseTime = 0.f;
-    float clockPeriod = 0.5f;
-    float elapsedTime = 0.f;
-
-    // Swing state
-    float swingAccumulator[NUM_TRACKS] = {0.f, 0.f, 0.f};
-    int stepParity[NUM_TRACKS] = {0, 0, 0};
-    bool pendingSwingGate[NUM_TRACKS] = {false, false, false};
-    int pendingSwingStep[NUM_TRACKS] = {0, 0, 0};
-    float outputPitch[NUM_TRACKS] = {0.f, 0.f, 0.f};
-    int outputStep[NUM_TRACKS] = {0, 0, 0};
-
-    // Clock multiplication state
-    float trackClockPhase[NUM_TRACKS] = {0.f, 0.f, 0.f};
-    int trackSubStep[NUM_TRACKS] = {0, 0, 0};
-
     // Gate button state tracking
     bool gateButtonStates[NUM_TRACKS * NUM_STEPS] = {false};
 
     // Previous encoder values for change detection
     float prevEncoderValues[NUM_STEPS] = {0.f};
 
+    // Buttons, encoders and knobs are polled at control rate; only the
+    // clock, reset and scene CV ports are read every sample
+    static const int UI_DIVISION = 32;
+    dsp::ClockDivider uiDivider;
+
+    // Engine inputs, knob fields refreshed by processUi()
+    SequencerCore::Inputs engineInputs;
+
+    // Poly output channels rounded up to a multiple of the SIMD width
+    static const int POLY_LANES = (NUM_TRACKS + 3) / 4 * 4;
+
+    // External clock smoothing, chosen from the context menu. Owned by the
+    // UI thread; the engine gets it through CMD_SET_CLOCK_SMOOTHING.
+    int clockSmoothingIndex = DEFAULT_CLOCK_SMOOTHING_INDEX;
+
+    // Lights are refreshed at display rate, not audio rate
+    static const int LIGHT_RATE = 120;
+    dsp::ClockDivider lightDivider;
+    uint32_t lastGateCount[NUM_TRACKS] = {};
+    uint32_t lastResetCount = 0;
+
+    // Scene encodings kept between autosaves, see patchStateToJson()
+    SceneJsonCache<SequencerCore> sceneJsonCache;
+
+    // Undo history of scene edits
+    SequencerCore::History history;
+
+    // What the panel widgets and menus show, published by the audio thread
+    // at light rate. The UI thread reads only this, and sends edits back
+    // through the engine's command queue (core.postCommand()).
+    struct UiState {
+        float bpm = 120.f;
+        bool externalClock = false;
+        int selectedTrack = 0;
+        bool lockSeed = false;
+        bool canUndo = false;
+        bool canRedo = false;
+        Quantizer quantizers[NUM_TRACKS];
+    };
+    Seqlock<UiState> uiState;
+
+    // What dataToJson saves, published by the audio thread whenever it
+    // changes, so saves and autosaves on the UI thread never read scenes
+    // the engine is editing
+    struct SaveState {
+        SequencerCore::PatchState patch;
+        uint32_t sceneRevision[NUM_SCENES] = {0};
+        int selectedTrack = 0;
+    };
+    Seqlock<SaveState> saveState;
+    // Last published state, owned by the audio thread
+    SaveState publishedSave;
+
     Sequencer() {
         config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
 
@@ -170,9 +175,12 @@ struct Sequencer : Module {
         }
 
         // Track controls (shared, apply to selected track)
-        configParam(STEPS_PARAM, 1.f, 8.f, 8.f, "Steps");
-        configSwitch(DIV_PARAM, 0.f, NUM_DIVISIONS - 1, 2.f, "Division",
-            {"1/1", "1/2", "1/4", "1/8", "1/8T", "1/16", "1/16T", "1/32"});
+        configParam(STEPS_PARAM, 1.f, NUM_STEPS, NUM_STEPS, "Steps");
+        std::vector<std::string> divisionLabels;
+        for (int i = 0; i < NUM_DIVISIONS; i++) {
+            divisionLabels.push_back(DIVISIONS[i].name);
+        }
+        configSwitch(DIV_PARAM, 0.f, NUM_DIVISIONS - 1, 2.f, "Division", divisionLabels);
         configSwitch(DIR_PARAM, 0.f, 3.f, 0.f, "Direction",
             {"Forward", "Reverse", "Pendulum", "Random"});
 
@@ -210,103 +218,105 @@ struct Sequencer : Module {
         // Outputs
         configOutput(CLOCK_OUTPUT, "Clock");
         configOutput(RESET_OUTPUT, "Reset");
-        configOutput(TRACK1_PITCH_OUTPUT, "Track 1 Pitch");
-        configOutput(TRACK1_GATE_OUTPUT, "Track 1 Gate");
-        configOutput(TRACK2_PITCH_OUTPUT, "Track 2 Pitch");
-        configOutput(TRACK2_GATE_OUTPUT, "Track 2 Gate");
-        configOutput(TRACK3_PITCH_OUTPUT, "Track 3 Pitch");
-        configOutput(TRACK3_GATE_OUTPUT, "Track 3 Gate");
+        for (int t = 0; t < NUM_TRACKS; t++) {
+            configOutput(pitchOutput(t), string::f("Track %d Pitch", t + 1));
+            configOutput(gateOutput(t), string::f("Track %d Gate", t + 1));
+        }
         configOutput(SCENE_CV_OUTPUT, "Scene CV");
+        configOutput(POLY_PITCH_OUTPUT, "Polyphonic pitch (one channel per track)");
+        configOutput(POLY_GATE_OUTPUT, "Polyphonic gate (one channel per track)");
+
+        uiDivider.setDivision(UI_DIVISION);
+        lightDivider.setDivision(44100 / LIGHT_RATE);
+
+        core.history = &history;
+        core.clockSmoothing = CLOCK_SMOOTHINGS[clockSmoothingIndex];
+
+        // Seed the engine's random direction generator
+        core.randomSeed = (uint64_t)random::u32() << 32 | random::u32();
 
-        // Initialize first scene
-        scenes[0].isEmpty = false;
+        publishSaveState(true);
+    }
+
+    void onSampleRateChange(const SampleRateChangeEvent& e) override {
+        lightDivider.setDivision(std::max(1, (int)(e.sampleRate / LIGHT_RATE)));
     }
 
     void onReset() override {
-        for (int i = 0; i < NUM_SCENES; i++) {
-            scenes[i] = SceneData();
-        }
-        scenes[0].isEmpty = false;
-        currentScene = 0;
+        core.clear();
         selectedTrack = 0;
-        copySourceScene = -1;
-        deleteMode = false;
-        for (int t = 0; t < NUM_TRACKS; t++) {
-            currentStep[t] = 0;
-            pendulumDir[t] = 1;
-            clockPhase[t] = 0.f;
-            swingAccumulator[t] = 0.f;
-            stepParity[t] = 0;
-            pendingSwingGate[t] = false;
-            pendingSwingStep[t] = 0;
-            outputPitch[t] = 0.f;
-            outputStep[t] = 0;
-            trackClockPhase[t] = 0.f;
-            trackSubStep[t] = 0;
-        }
-        isRunning = true;
-        internalClockPhase = 0.f;
-        elapsedTime = 0.f;
-        lastClockRiseTime = 0.f;
+        clockSmoothingIndex = DEFAULT_CLOCK_SMOOTHING_INDEX;
         loadTrackToEncoders();
+        publishSaveState();
+    }
+
+    // Called from the UI thread
+    void newRandomSeeds() {
+        for (int t = 0; t < NUM_TRACKS; t++) {
+            Command command;
+            command.type = CMD_SET_SEED;
+            command.track = t;
+            command.seed = random::u32();
+            core.postCommand(command);
+        }
+    }
+
+    void postCommand(CommandType type, int track = 0, int amount = 0) {
+        Command command;
+        command.type = type;
+        command.track = track;
+        command.amount = amount;
+        core.postCommand(command);
+    }
+
+    void setClockSmoothing(int index) {
+        clockSmoothingIndex = index;
+        Command command;
+        command.type = CMD_SET_CLOCK_SMOOTHING;
+        command.smoothing = CLOCK_SMOOTHINGS[index];
+        core.postCommand(command);
+    }
+
+    void postQuantizer(int track, int scale, int root) {
+        Command command;
+        command.type = CMD_SET_QUANTIZER;
+        command.track = track;
+        command.scale = scale;
+        command.root = root;
+        core.postCommand(command);
     }
 
     void loadTrackToEncoders() {
         // Load selected track's pitches into encoder params
-        SceneData& scene = scenes[currentScene];
+        TrackData& trackData = core.track(selectedTrack);
         for (int s = 0; s < NUM_STEPS; s++) {
-            params[PITCH_PARAMS + s].setValue(scene.tracks[selectedTrack].pitches[s]);
-            prevEncoderValues[s] = scene.tracks[selectedTrack].pitches[s];
+            float volts = codeToPitch(trackData.pitches[s]);
+            params[PITCH_PARAMS + s].setValue(volts);
+            prevEncoderValues[s] = volts;
         }
         // Load track controls
-        params[STEPS_PARAM].setValue(scene.tracks[selectedTrack].stepCount);
-        params[DIV_PARAM].setValue(scene.tracks[selectedTrack].divisionIndex);
-        params[DIR_PARAM].setValue((float)scene.tracks[selectedTrack].direction);
+        params[STEPS_PARAM].setValue(trackData.stepCount);
+        params[DIV_PARAM].setValue(trackData.divisionIndex);
+        params[DIR_PARAM].setValue((float)trackData.direction);
     }
 
     void saveEncodersToTrack() {
         // Save encoder values to selected track's pitches
-        SceneData& scene = scenes[currentScene];
         for (int s = 0; s < NUM_STEPS; s++) {
-            scene.tracks[selectedTrack].pitches[s] = params[PITCH_PARAMS + s].getValue();
+            core.setPitch(selectedTrack, s, pitchToCode(params[PITCH_PARAMS + s].getValue()));
         }
         // Save track controls
-        scene.tracks[selectedTrack].stepCount = (int)params[STEPS_PARAM].getValue();
-        scene.tracks[selectedTrack].divisionIndex = (int)params[DIV_PARAM].getValue();
-        scene.tracks[selectedTrack].direction = (Direction)(int)params[DIR_PARAM].getValue();
+        saveTrackSettings();
     }
 
-    void advanceStep(int track) {
-        SceneData& scene = scenes[currentScene];
-        TrackData& trackData = scene.tracks[track];
-        int steps = trackData.stepCount;
-
-        switch (trackData.direction) {
-            case DIR_FORWARD:
-                currentStep[track] = (currentStep[track] + 1) % steps;
-                break;
-            case DIR_REVERSE:
-                currentStep[track] = (currentStep[track] - 1 + steps) % steps;
-                break;
-            case DIR_PENDULUM:
-                currentStep[track] += pendulumDir[track];
-                if (currentStep[track] >= steps - 1) {
-                    currentStep[track] = steps - 1;
-                    pendulumDir[track] = -1;
-                } else if (currentStep[track] <= 0) {
-                    currentStep[track] = 0;
-                    pendulumDir[track] = 1;
-                }
-                break;
-            case DIR_RANDOM:
-                currentStep[track] = random::u32() % steps;
-                break;
-        }
+    void saveTrackSettings() {
+        core.setTrackSettings(selectedTrack,
+            (int)params[STEPS_PARAM].getValue(),
+            (int)params[DIV_PARAM].getValue(),
+            (Direction)(int)params[DIR_PARAM].getValue());
     }
 
-    void process(const ProcessArgs& args) override {
-        SceneData& scene = scenes[currentScene];
-
+    void processUi() {
         // Handle track select buttons (radio-style)
         for (int t = 0; t < NUM_TRACKS; t++) {
             if (trackSelectTriggers[t].process(params[TRACK_SELECT_PARAMS + t].getValue() > 0.f)) {
@@ -322,15 +332,13 @@ struct Sequencer : Module {
         for (int s = 0; s < NUM_STEPS; s++) {
             float val = params[PITCH_PARAMS + s].getValue();
             if (val != prevEncoderValues[s]) {
-                scene.tracks[selectedTrack].pitches[s] = val;
+                core.setPitch(selectedTrack, s, pitchToCode(val));
                 prevEncoderValues[s] = val;
             }
         }
 
         // Save track control changes to current track
-        scene.tracks[selectedTrack].stepCount = (int)params[STEPS_PARAM].getValue();
-        scene.tracks[selectedTrack].divisionIndex = (int)params[DIV_PARAM].getValue();
-        scene.tracks[selectedTrack].direction = (Direction)(int)params[DIR_PARAM].getValue();
+        saveTrackSettings();
 
         // Handle gate button toggles
         for (int t = 0; t < NUM_TRACKS; t++) {
@@ -338,61 +346,22 @@ struct Sequencer : Module {
                 int idx = t * NUM_STEPS + s;
                 bool pressed = params[GATE_PARAMS + idx].getValue() > 0.f;
                 if (pressed && !gateButtonStates[idx]) {
-                    scene.tracks[t].gates[s] = !scene.tracks[t].gates[s];
+                    core.toggleGate(t, s);
                 }
                 gateButtonStates[idx] = pressed;
             }
         }
 
-        // Handle reset
-        bool resetFromInput = resetTrigger.process(inputs[RESET_INPUT].getVoltage());
-        bool resetFromButton = rstButtonTrigger.process(params[RST_PARAM].getValue() > 0.f);
-        if (resetFromInput || resetFromButton) {
-            for (int t = 0; t < NUM_TRACKS; t++) {
-                currentStep[t] = 0;
-                pendulumDir[t] = 1;
-                clockPhase[t] = 0.f;
-            }
-            internalClockPhase = 0.f;
-            resetOutputPulse.trigger(0.001f);
-        }
-        outputs[RESET_OUTPUT].setVoltage(resetOutputPulse.process(args.sampleTime) ? 10.f : 0.f);
-
-        // Handle scene CV input
-        if (inputs[SCENE_CV_INPUT].isConnected()) {
-            float sceneCV = inputs[SCENE_CV_INPUT].getVoltage();
-            int newScene = clamp((int)sceneCV, 0, NUM_SCENES - 1);
-            if (newScene != currentScene && !scenes[newScene].isEmpty) {
-                saveEncodersToTrack();
-                currentScene = newScene;
-                loadTrackToEncoders();
-            }
+        // Reset button
+        if (rstButtonTrigger.process(params[RST_PARAM].getValue() > 0.f)) {
+            core.resetPlayback();
         }
 
         // Handle scene buttons
         for (int s = 0; s < NUM_SCENES; s++) {
             if (sceneTriggers[s].process(params[SCENE_PARAMS + s].getValue() > 0.f)) {
-                if (copySourceScene >= 0) {
-                    scenes[s] = scenes[copySourceScene];
-                    scenes[s].isEmpty = false;
-                    copySourceScene = -1;
-                    saveEncodersToTrack();
-                    currentScene = s;
-                    loadTrackToEncoders();
-                } else if (deleteMode && s != 0) {
-                    scenes[s] = SceneData();
-                    deleteMode = false;
-                    if (currentScene == s) {
-                        currentScene = 0;
-                        loadTrackToEncoders();
-                    }
-                } else {
-                    if (scenes[s].isEmpty) {
-                        scenes[s] = scenes[currentScene];
-                        scenes[s].isEmpty = false;
-                    }
-                    saveEncodersToTrack();
-                    currentScene = s;
+                saveEncodersToTrack();
+                if (core.pressScene(s)) {
                     loadTrackToEncoders();
                 }
             }
@@ -400,258 +369,185 @@ struct Sequencer : Module {
 
         // Copy button
         if (copyTrigger.process(params[COPY_PARAM].getValue() > 0.f)) {
-            deleteMode = false;
-            copySourceScene = (copySourceScene < 0) ? currentScene : -1;
+            core.pressCopy();
         }
 
         // Delete button
         if (deleteTrigger.process(params[DELETE_PARAM].getValue() > 0.f)) {
-            copySourceScene = -1;
-            deleteMode = !deleteMode;
+            core.pressDelete();
         }
 
         // Run/stop button
         if (runTrigger.process(params[RUN_PARAM].getValue() > 0.f)) {
-            isRunning = !isRunning;
+            core.toggleRun();
         }
 
-        // Track elapsed time
-        elapsedTime += args.sampleTime;
-
-        // Get groove params
-        float swingAmount = params[SWING_PARAM].getValue() / 100.f;
-        float pulseWidth = params[PW_PARAM].getValue() / 100.f;
-
-        // Clock generation
-        float bpm = params[BPM_PARAM].getValue();
-        bool useInternalClock = !inputs[CLOCK_INPUT].isConnected();
-        bool clockRising = false;
-
-        float clockFreq = bpm / 60.f;
-        clockPeriod = 1.f / clockFreq;
+        // Knobs
+        engineInputs.bpm = params[BPM_PARAM].getValue();
+        engineInputs.swing = params[SWING_PARAM].getValue() / 100.f;
+        engineInputs.pulseWidth = params[PW_PARAM].getValue() / 100.f;
+    }
 
-        if (isRunning) {
-            if (useInternalClock) {
-                internalClockPhase += clockFreq * args.sampleTime;
-                if (internalClockPhase >= 1.f) {
-                    internalClockPhase -= 1.f;
-                    clockRising = true;
-                    clockOutputPulse.trigger(0.001f);
-                }
-            } else {
-                clockRising = clockTrigger.process(inputs[CLOCK_INPUT].getVoltage());
-                if (clockRising) {
-                    float timeSinceLastClock = elapsedTime - lastClockRiseTime;
-                    if (timeSinceLastClock > 0.01f && timeSinceLastClock < 4.f) {
-                        clockPeriod = timeSinceLastClock;
-                    }
-                    lastClockRiseTime = elapsedTime;
-                    clockOutputPulse.trigger(0.001f);
-                }
-            }
+    void process(const ProcessArgs& args) override {
+        if (uiDivider.process()) {
+            processUi();
         }
-        outputs[CLOCK_OUTPUT].setVoltage(clockOutputPulse.process(args.sampleTime) ? 10.f : 0.f);
-
-        // Process each track
-        for (int t = 0; t < NUM_TRACKS; t++) {
-            TrackData& trackData = scene.tracks[t];
-            float division = DIVISIONS[trackData.divisionIndex];
-            bool shouldAdvance = false;
-
-            float stepDuration = clockPeriod * division;
-            float gateDuration = stepDuration * pulseWidth;
-            gateDuration = clamp(gateDuration, 0.001f, stepDuration * 0.95f);
-
-            if (division >= 1.f) {
-                if (clockRising) {
-                    clockPhase[t] += 1.f / division;
-                    if (clockPhase[t] >= 1.f) {
-                        clockPhase[t] -= 1.f;
-                        shouldAdvance = true;
-                    }
-                }
-            } else {
-                int stepsPerClock = (int)(1.f / division);
-                if (clockRising) {
-                    trackSubStep[t] = 0;
-                    trackClockPhase[t] = 0.f;
-                    shouldAdvance = true;
-                } else if (isRunning && clockPeriod > 0.f) {
-                    trackClockPhase[t] += args.sampleTime;
-                    float stepInterval = clockPeriod / stepsPerClock;
-                    int expectedSubStep = (int)(trackClockPhase[t] / stepInterval);
-                    if (expectedSubStep >= stepsPerClock) {
-                        expectedSubStep = stepsPerClock - 1;
-                    }
-                    if (expectedSubStep > trackSubStep[t]) {
-                        trackSubStep[t] = expectedSubStep;
-                        shouldAdvance = true;
-                    }
-                }
-            }
-
-            if (shouldAdvance) {
-                advanceStep(t);
-                stepParity[t] = (stepParity[t] + 1) % 2;
-
-                float swingDelay = 0.f;
-                if (stepParity[t] == 1 && swingAmount > 0.f) {
-                    swingDelay = clockPeriod * (division >= 1.f ? division : 1.f) * swingAmount * 0.5f;
-                }
-
-                if (trackData.gates[currentStep[t]]) {
-                    if (swingDelay > 0.001f) {
-                        swingAccumulator[t] = swingDelay;
-                        pendingSwingGate[t] = true;
-                        pendingSwingStep[t] = currentStep[t];
-                    } else {
-                        gatePulse[t].trigger(gateDuration);
-                        outputPitch[t] = trackData.pitches[currentStep[t]];
-                        outputStep[t] = currentStep[t];
-                    }
-                } else {
-                    if (swingDelay <= 0.001f) {
-                        outputPitch[t] = trackData.pitches[currentStep[t]];
-                        outputStep[t] = currentStep[t];
-                    }
-                }
-            }
 
-            if (pendingSwingGate[t] && swingAccumulator[t] > 0.f) {
-                swingAccumulator[t] -= args.sampleTime;
-                if (swingAccumulator[t] <= 0.f) {
-                    swingAccumulator[t] = 0.f;
-                    gatePulse[t].trigger(gateDuration);
-                    outputPitch[t] = scene.tracks[t].pitches[pendingSwingStep[t]];
-                    outputStep[t] = pendingSwingStep[t];
-                    pendingSwingGate[t] = false;
-                }
-            }
+        // Run the engine
+        SequencerCore::Inputs& in = engineInputs;
+        in.sampleRate = args.sampleRate;
+        in.clockConnected = inputs[CLOCK_INPUT].isConnected();
+        in.clock = inputs[CLOCK_INPUT].getVoltage();
+        in.reset = inputs[RESET_INPUT].getVoltage();
+        in.sceneCvConnected = inputs[SCENE_CV_INPUT].isConnected();
+        in.sceneCv = inputs[SCENE_CV_INPUT].getVoltage();
+
+        SequencerCore::Outputs out;
+        core.process(in, out);
+        if (out.sceneChanged) {
+            loadTrackToEncoders();
         }
 
-        // Outputs
-        int pitchOutputs[NUM_TRACKS] = {TRACK1_PITCH_OUTPUT, TRACK2_PITCH_OUTPUT, TRACK3_PITCH_OUTPUT};
-        int gateOutputs[NUM_TRACKS] = {TRACK1_GATE_OUTPUT, TRACK2_GATE_OUTPUT, TRACK3_GATE_OUTPUT};
-
+        // Outputs. Track voltages padded to whole SIMD vectors for the poly outputs
+        float pitchLanes[POLY_LANES] = {0.f};
+        float gateLanes[POLY_LANES] = {0.f};
         for (int t = 0; t < NUM_TRACKS; t++) {
-            outputs[pitchOutputs[t]].setVoltage(outputPitch[t]);
-            bool gateOn = isRunning ? gatePulse[t].process(args.sampleTime) : scene.tracks[t].gates[currentStep[t]];
-            outputs[gateOutputs[t]].setVoltage(gateOn ? 10.f : 0.f);
+            pitchLanes[t] = out.pitch[t];
+            gateLanes[t] = out.gate[t] ? 10.f : 0.f;
+            outputs[pitchOutput(t)].setVoltage(pitchLanes[t]);
+            outputs[gateOutput(t)].setVoltage(gateLanes[t]);
         }
-        outputs[SCENE_CV_OUTPUT].setVoltage((float)currentScene);
+        for (int c = 0; c < NUM_TRACKS; c += 4) {
+            outputs[POLY_PITCH_OUTPUT].setVoltageSimd(simd::float_4::load(&pitchLanes[c]), c);
+            outputs[POLY_GATE_OUTPUT].setVoltageSimd(simd::float_4::load(&gateLanes[c]), c);
+        }
+        outputs[POLY_PITCH_OUTPUT].setChannels(NUM_TRACKS);
+        outputs[POLY_GATE_OUTPUT].setChannels(NUM_TRACKS);
+        outputs[CLOCK_OUTPUT].setVoltage(out.clock ? 10.f : 0.f);
+        outputs[RESET_OUTPUT].setVoltage(out.reset ? 10.f : 0.f);
+        outputs[SCENE_CV_OUTPUT].setVoltage(out.sceneCv);
+
+        if (lightDivider.process()) {
+            processLights(args.sampleTime * lightDivider.getDivision());
+        }
+    }
 
-        // Update LEDs
+    void processLights(float deltaTime) {
         // Track select LEDs
         for (int t = 0; t < NUM_TRACKS; t++) {
             lights[TRACK_SELECT_LIGHTS + t].setBrightness(t == selectedTrack ? 1.f : 0.2f);
         }
 
         // Gate and step LEDs
+        SceneData& scene = core.scenes[core.currentScene];
         for (int t = 0; t < NUM_TRACKS; t++) {
-            bool gateOutputHigh = gatePulse[t].remaining > 0.f;
+            // Count any gate fired since the last update, however short
+            bool gateOutputHigh = core.gateHigh(t) || core.gateCount[t] != lastGateCount[t];
+            lastGateCount[t] = core.gateCount[t];
             for (int s = 0; s < NUM_STEPS; s++) {
                 int idx = t * NUM_STEPS + s;
-                lights[GATE_LIGHTS + idx].setBrightness(scene.tracks[t].gates[s] ? 1.f : 0.1f);
-                if (outputStep[t] == s) {
-                    lights[STEP_LIGHTS + idx].setBrightness(isRunning ? (gateOutputHigh ? 1.f : 0.3f) : 1.f);
+                lights[GATE_LIGHTS + idx].setBrightness(scene.tracks[t].gate(s) ? 1.f : 0.1f);
+                if (core.outputStep[t] == s) {
+                    lights[STEP_LIGHTS + idx].setBrightnessSmooth(core.isRunning ? (gateOutputHigh ? 1.f : 0.3f) : 1.f, deltaTime);
                 } else {
-                    lights[STEP_LIGHTS + idx].setBrightness(0.f);
+                    lights[STEP_LIGHTS + idx].setBrightnessSmooth(0.f, deltaTime);
                 }
             }
         }
 
         // Scene LEDs
         for (int s = 0; s < NUM_SCENES; s++) {
-            bool isCurrent = (s == currentScene);
-            bool isEmpty = scenes[s].isEmpty;
-            bool isCopySource = (s == copySourceScene);
+            bool isCurrent = (s == core.currentScene);
+            bool isEmpty = core.scenes[s].isEmpty;
+            bool isCopySource = (s == core.copySourceScene);
             lights[SCENE_LIGHTS + s * 3 + 0].setBrightness(isCopySource ? 1.f : 0.f);
             lights[SCENE_LIGHTS + s * 3 + 1].setBrightness(isCurrent ? 1.f : 0.f);
             lights[SCENE_LIGHTS + s * 3 + 2].setBrightness(!isEmpty ? 0.5f : 0.1f);
         }
 
-        lights[COPY_LIGHT].setBrightness(copySourceScene >= 0 ? 1.f : 0.f);
-        lights[DELETE_LIGHT].setBrightness(deleteMode ? 1.f : 0.f);
-        lights[RUN_LIGHT].setBrightness(isRunning ? 1.f : 0.f);
-        lights[RST_LIGHT].setBrightness(resetOutputPulse.remaining > 0.f ? 1.f : 0.f);
-    }
+        lights[COPY_LIGHT].setBrightness(core.copySourceScene >= 0 ? 1.f : 0.f);
+        lights[DELETE_LIGHT].setBrightness(core.deleteMode ? 1.f : 0.f);
+        lights[RUN_LIGHT].setBrightness(core.isRunning ? 1.f : 0.f);
+        bool resetHigh = core.resetOutputPulse.isHigh(core.sampleCount) || core.resetCount != lastResetCount;
+        lastResetCount = core.resetCount;
+        lights[RST_LIGHT].setBrightnessSmooth(resetHigh ? 1.f : 0.f, deltaTime);
+
+        // State for the UI thread
+        UiState state;
+        state.externalClock = inputs[CLOCK_INPUT].isConnected();
+        state.bpm = params[BPM_PARAM].getValue();
+        if (state.externalClock && core.clockPeriodSamples > 0) {
+            state.bpm = core.clockBpm();
+        }
+        state.selectedTrack = selectedTrack;
+        state.lockSeed = core.lockSeed;
+        state.canUndo = history.undoCount > 0;
+        state.canRedo = history.redoCount > 0;
+        for (int t = 0; t < NUM_TRACKS; t++) {
+            state.quantizers[t] = core.quantizers[t];
+        }
+        uiState.write(state);
 
-    json_t* dataToJson() override {
-        json_t* rootJ = json_object();
-        json_object_set_new(rootJ, "currentScene", json_integer(currentScene));
-        json_object_set_new(rootJ, "selectedTrack", json_integer(selectedTrack));
-        json_object_set_new(rootJ, "isRunning", json_boolean(isRunning));
+        publishSaveState();
+    }
 
-        json_t* scenesJ = json_array();
+    // Publishes the patch state for dataToJson if it changed since the
+    // last call. Runs on the audio thread, or with the engine locked.
+    void publishSaveState(bool force = false) {
+        SaveState& state = publishedSave;
+        bool changed = force;
         for (int i = 0; i < NUM_SCENES; i++) {
-            json_t* sceneJ = json_object();
-            json_object_set_new(sceneJ, "isEmpty", json_boolean(scenes[i].isEmpty));
-
-            json_t* tracksJ = json_array();
-            for (int t = 0; t < NUM_TRACKS; t++) {
-                json_t* trackJ = json_object();
-                json_object_set_new(trackJ, "stepCount", json_integer(scenes[i].tracks[t].stepCount));
-                json_object_set_new(trackJ, "divisionIndex", json_integer(scenes[i].tracks[t].divisionIndex));
-                json_object_set_new(trackJ, "direction", json_integer(scenes[i].tracks[t].direction));
-
-                json_t* pitchesJ = json_array();
-                json_t* gatesJ = json_array();
-                for (int s = 0; s < NUM_STEPS; s++) {
-                    json_array_append_new(pitchesJ, json_real(scenes[i].tracks[t].pitches[s]));
-                    json_array_append_new(gatesJ, json_boolean(scenes[i].tracks[t].gates[s]));
-                }
-                json_object_set_new(trackJ, "pitches", pitchesJ);
-                json_object_set_new(trackJ, "gates", gatesJ);
-                json_array_append_new(tracksJ, trackJ);
+            if (force || state.sceneRevision[i] != core.sceneRevision[i]) {
+                state.patch.scenes[i] = core.scenes[i];
+                state.sceneRevision[i] = core.sceneRevision[i];
+                changed = true;
+            }
+        }
+        for (int t = 0; t < NUM_TRACKS; t++) {
+            const Quantizer& quantizer = core.quantizers[t];
+            if (state.patch.quantizers[t].scale != quantizer.scale || state.patch.quantizers[t].root != quantizer.root) {
+                state.patch.quantizers[t] = quantizer;
+                changed = true;
             }
-            json_object_set_new(sceneJ, "tracks", tracksJ);
-            json_array_append_new(scenesJ, sceneJ);
         }
-        json_object_set_new(rootJ, "scenes", scenesJ);
+        if (state.patch.currentScene != core.currentScene || state.patch.isRunning != core.isRunning
+            || state.patch.lockSeed != core.lockSeed || state.selectedTrack != selectedTrack) {
+            state.patch.currentScene = core.currentScene;
+            state.patch.isRunning = core.isRunning;
+            state.patch.lockSeed = core.lockSeed;
+            state.selectedTrack = selectedTrack;
+            changed = true;
+        }
+        if (changed)
+            saveState.write(state);
+    }
+
+    json_t* dataToJson() override {
+        // From the audio thread's last published state, see SaveState
+        SaveState state = saveState.read();
+        json_t* rootJ = json_object();
+        patchStateToJson<SequencerCore>(state.patch, rootJ, &sceneJsonCache, state.sceneRevision);
+        json_object_set_new(rootJ, "selectedTrack", json_integer(state.selectedTrack));
+        json_object_set_new(rootJ, "clockSmoothing", json_integer(clockSmoothingIndex));
         return rootJ;
     }
 
     void dataFromJson(json_t* rootJ) override {
-        json_t* currentSceneJ = json_object_get(rootJ, "currentScene");
-        if (currentSceneJ) currentScene = json_integer_value(currentSceneJ);
+        // Decoded and validated as a whole before anything is replaced.
+        // Rack holds the engine lock around fromJson, so the audio thread is
+        // not running and the state is loaded right away: a toJson straight
+        // after (the load/paste history action, an autosave) already sees it.
+        engineFromJson(core, rootJ);
 
         json_t* selectedTrackJ = json_object_get(rootJ, "selectedTrack");
-        if (selectedTrackJ) selectedTrack = json_integer_value(selectedTrackJ);
-
-        json_t* isRunningJ = json_object_get(rootJ, "isRunning");
-        if (isRunningJ) isRunning = json_boolean_value(isRunningJ);
-
-        json_t* scenesJ = json_object_get(rootJ, "scenes");
-        if (scenesJ) {
-            for (int i = 0; i < NUM_SCENES && i < (int)json_array_size(scenesJ); i++) {
-                json_t* sceneJ = json_array_get(scenesJ, i);
-                json_t* isEmptyJ = json_object_get(sceneJ, "isEmpty");
-                if (isEmptyJ) scenes[i].isEmpty = json_boolean_value(isEmptyJ);
-
-                json_t* tracksJ = json_object_get(sceneJ, "tracks");
-                if (tracksJ) {
-                    for (int t = 0; t < NUM_TRACKS && t < (int)json_array_size(tracksJ); t++) {
-                        json_t* trackJ = json_array_get(tracksJ, t);
-                        json_t* stepCountJ = json_object_get(trackJ, "stepCount");
-                        if (stepCountJ) scenes[i].tracks[t].stepCount = json_integer_value(stepCountJ);
-                        json_t* divisionIndexJ = json_object_get(trackJ, "divisionIndex");
-                        if (divisionIndexJ) scenes[i].tracks[t].divisionIndex = json_integer_value(divisionIndexJ);
-                        json_t* directionJ = json_object_get(trackJ, "direction");
-                        if (directionJ) scenes[i].tracks[t].direction = (Direction)json_integer_value(directionJ);
-
-                        json_t* pitchesJ = json_object_get(trackJ, "pitches");
-                        json_t* gatesJ = json_object_get(trackJ, "gates");
-                        for (int s = 0; s < NUM_STEPS; s++) {
-                            if (pitchesJ && s < (int)json_array_size(pitchesJ))
-                                scenes[i].tracks[t].pitches[s] = json_real_value(json_array_get(pitchesJ, s));
-                            if (gatesJ && s < (int)json_array_size(gatesJ))
-                                scenes[i].tracks[t].gates[s] = json_boolean_value(json_array_get(gatesJ, s));
-                        }
-                    }
-                }
-            }
-        }
+        if (json_is_integer(selectedTrackJ)) selectedTrack = clamp((int)json_integer_value(selectedTrackJ), 0, NUM_TRACKS - 1);
+
+        json_t* clockSmoothingJ = json_object_get(rootJ, "clockSmoothing");
+        if (json_is_integer(clockSmoothingJ)) clockSmoothingIndex = clamp((int)json_integer_value(clockSmoothingJ), 0, NUM_CLOCK_SMOOTHINGS - 1);
+        core.clockSmoothing = CLOCK_SMOOTHINGS[clockSmoothingIndex];
+
         loadTrackToEncoders();
+        publishSaveState();
     }
 };
 
@@ -666,11 +562,9 @@ struct BpmDisplay : Widget {
         nvgFill(args.vg);
 
         if (module) {
-            float bpm = module->params[Sequencer::BPM_PARAM].getValue();
-            bool isInternal = !module->inputs[Sequencer::CLOCK_INPUT].isConnected();
-            if (!isInternal && module->clockPeriod > 0.f) {
-                bpm = 60.f / module->clockPeriod;
-            }
+            Sequencer::UiState state = module->uiState.read();
+            float bpm = state.bpm;
+            bool isInternal = !state.externalClock;
 
             nvgFontSize(args.vg, 14);
             nvgFillColor(args.vg, nvgRGB(255, 200, 50));
@@ -772,12 +666,10 @@ struct SequencerWidget : ModuleWidget {
 
         // ========== RIGHT COLUMN: OUTPUTS (x=93, 10mm spacing) ==========
         float outX = 93;
-        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(outX, 22)), module, Sequencer::TRACK1_PITCH_OUTPUT));
-        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(outX, 32)), module, Sequencer::TRACK1_GATE_OUTPUT));
-        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(outX, 42)), module, Sequencer::TRACK2_PITCH_OUTPUT));
-        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(outX, 52)), module, Sequencer::TRACK2_GATE_OUTPUT));
-        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(outX, 62)), module, Sequencer::TRACK3_PITCH_OUTPUT));
-        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(outX, 72)), module, Sequencer::TRACK3_GATE_OUTPUT));
+        for (int t = 0; t < NUM_TRACKS; t++) {
+            addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(outX, 22 + t * 20)), module, Sequencer::pitchOutput(t)));
+            addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(outX, 32 + t * 20)), module, Sequencer::gateOutput(t)));
+        }
         addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(outX, 82)), module, Sequencer::CLOCK_OUTPUT));
         addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(outX, 92)), module, Sequencer::RESET_OUTPUT));
 
@@ -804,6 +696,109 @@ struct SequencerWidget : ModuleWidget {
 
         // SCV OUT (x=93, y=106)
         addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(outX, 106)), module, Sequencer::SCENE_CV_OUTPUT));
+
+        // POLY: PIT, GATE (x=7, 16, y=106)
+        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(7, 106)), module, Sequencer::POLY_PITCH_OUTPUT));
+        addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(16, 106)), module, Sequencer::POLY_GATE_OUTPUT));
+    }
+
+    void appendContextMenu(Menu* menu) override {
+        Sequencer* module = getModule<Sequencer>();
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createIndexSubmenuItem("External clock smoothing",
+            {"Off (hard sync)", "Light", "Medium", "Heavy"},
+            [=]() {
+                return (size_t)module->clockSmoothingIndex;
+            },
+            [=](size_t index) {
+                module->setClockSmoothing((int)index);
+            }));
+        Sequencer::UiState state = module->uiState.read();
+        menu->addChild(createBoolMenuItem("Lock random seed", "",
+            [=]() {
+                return module->uiState.read().lockSeed;
+            },
+            [=](bool lockSeed) {
+                Command command;
+                command.type = CMD_SET_LOCK_SEED;
+                command.on = lockSeed;
+                module->core.postCommand(command);
+            }));
+        menu->addChild(createMenuItem("New random seeds for this scene", "", [=]() {
+            module->newRandomSeeds();
+        }));
+
+        menu->addChild(new MenuSeparator);
+        int track = state.selectedTrack;
+        menu->addChild(createSubmenuItem(string::f("Track %d gates", track + 1), "", [=](Menu* menu) {
+            menu->addChild(createMenuItem("Rotate left", "", [=]() {
+                module->postCommand(CMD_ROTATE_GATES, track, -1);
+            }));
+            menu->addChild(createMenuItem("Rotate right", "", [=]() {
+                module->postCommand(CMD_ROTATE_GATES, track, 1);
+            }));
+            menu->addChild(createMenuItem("Invert", "", [=]() {
+                module->postCommand(CMD_INVERT_GATES, track);
+            }));
+            menu->addChild(createSubmenuItem("Euclidean fill", "", [=](Menu* menu) {
+                for (int pulses = 0; pulses <= NUM_STEPS; pulses++) {
+                    menu->addChild(createMenuItem(string::f("%d pulses", pulses), "", [=]() {
+                        module->postCommand(CMD_EUCLID_GATES, track, pulses);
+                    }));
+                }
+            }));
+        }));
+        menu->addChild(createSubmenuItem(string::f("Track %d quantizer", track + 1), "", [=](Menu* menu) {
+            static const char* NOTE_NAMES[12] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+            // Settings as of opening the menu; every item changes one field
+            Quantizer quantizer = module->uiState.read().quantizers[track];
+            menu->addChild(createCheckMenuItem("Off", "",
+                [=]() {
+                    return quantizer.scale == 0;
+                },
+                [=]() {
+                    module->postQuantizer(track, 0, quantizer.root);
+                }));
+            for (int i = 0; i < NUM_SCALES; i++) {
+                menu->addChild(createCheckMenuItem(SCALES[i].name, "",
+                    [=]() {
+                        return quantizer.scale == SCALES[i].notes;
+                    },
+                    [=]() {
+                        module->postQuantizer(track, SCALES[i].notes, quantizer.root);
+                    }));
+            }
+            std::vector<std::string> noteLabels(NOTE_NAMES, NOTE_NAMES + 12);
+            menu->addChild(createIndexSubmenuItem("Root", noteLabels,
+                [=]() {
+                    return (size_t)quantizer.root;
+                },
+                [=](size_t root) {
+                    module->postQuantizer(track, quantizer.scale, (int)root);
+                }));
+            // User scales: any set of notes, counted from the root
+            menu->addChild(createSubmenuItem("Notes", "", [=](Menu* menu) {
+                for (int n = 0; n < 12; n++) {
+                    menu->addChild(createBoolMenuItem(NOTE_NAMES[(quantizer.root + n) % 12], "",
+                        [=]() {
+                            return (module->uiState.read().quantizers[track].scale >> n) & 1;
+                        },
+                        [=](bool on) {
+                            int scale = module->uiState.read().quantizers[track].scale;
+                            scale = on ? scale | 1 << n : scale & ~(1 << n);
+                            module->postQuantizer(track, scale, quantizer.root);
+                        }));
+                }
+            }));
+        }));
+
+        menu->addChild(createMenuItem("Undo scene edit", "", [=]() {
+            module->postCommand(CMD_UNDO);
+        }, !state.canUndo));
+        menu->addChild(createMenuItem("Redo scene edit", "", [=]() {
+            module->postCommand(CMD_REDO);
+        }, !state.canRedo));
     }
 };
 
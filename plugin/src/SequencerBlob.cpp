@@ -0,0 +1,163 @@
+#include "SequencerBlob.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+static const uint8_t BLOB_MAGIC[2] = {'S', 'Q'};
+static const uint8_t FLAG_EMPTY = 1;
+
+static void putU32(uint8_t* p, uint32_t x) {
+    p[0] = (uint8_t)x;
+    p[1] = (uint8_t)(x >> 8);
+    p[2] = (uint8_t)(x >> 16);
+    p[3] = (uint8_t)(x >> 24);
+}
+
+static uint32_t getU32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Byte size of one track's record in a blob with `steps` steps
+static size_t trackSize(int steps) {
+    return 7 + (steps + 7) / 8 + (steps * 12 + 7) / 8;
+}
+
+template <int TRACKS, int STEPS>
+void SceneBlobT<TRACKS, STEPS>::encode(const SceneDataT<TRACKS, STEPS>& scene) {
+    uint8_t* p = bytes;
+    std::memset(bytes, 0, SIZE);
+    p[0] = BLOB_MAGIC[0];
+    p[1] = BLOB_MAGIC[1];
+    p[2] = SCENE_BLOB_VERSION;
+    p[3] = TRACKS;
+    p[4] = STEPS;
+    p[5] = scene.isEmpty ? FLAG_EMPTY : 0;
+    p += HEADER_SIZE;
+
+    for (int t = 0; t < TRACKS; t++) {
+        const TrackDataT<STEPS>& trackData = scene.tracks[t];
+        p[0] = (uint8_t)trackData.stepCount;
+        p[1] = (uint8_t)trackData.divisionIndex;
+        p[2] = (uint8_t)trackData.direction;
+        putU32(p + 3, trackData.seed);
+        // Gate bitmask, little endian
+        uint8_t* gates = p + 7;
+        uint8_t* pitches = gates + (STEPS + 7) / 8;
+        for (int i = 0; i < (STEPS + 7) / 8; i++) {
+            gates[i] = (uint8_t)((uint64_t)trackData.gates >> (8 * i));
+        }
+        for (int s = 0; s < STEPS; s++) {
+            int bit = s * 12;
+            uint32_t code = (uint32_t)(trackData.pitches[s] & PITCH_CODE_MAX) << (bit % 8);
+            pitches[bit / 8] |= (uint8_t)code;
+            pitches[bit / 8 + 1] |= (uint8_t)(code >> 8);
+        }
+        p += TRACK_SIZE;
+    }
+    putU32(p, crc32(bytes, SIZE - 4));
+}
+
+template <int TRACKS, int STEPS>
+bool SceneBlobT<TRACKS, STEPS>::decode(const uint8_t* data, size_t size, SceneDataT<TRACKS, STEPS>& scene) {
+    if (size < HEADER_SIZE + 4 || data[0] != BLOB_MAGIC[0] || data[1] != BLOB_MAGIC[1] || data[2] != SCENE_BLOB_VERSION)
+        return false;
+    int blobTracks = data[3];
+    int blobSteps = data[4];
+    size_t blobTrackSize = trackSize(blobSteps);
+    if (size != HEADER_SIZE + blobTracks * blobTrackSize + 4)
+        return false;
+    if (crc32(data, size - 4) != getU32(data + size - 4))
+        return false;
+
+    scene.isEmpty = data[5] & FLAG_EMPTY;
+    const uint8_t* p = data + HEADER_SIZE;
+    for (int t = 0; t < std::min(blobTracks, TRACKS); t++) {
+        TrackDataT<STEPS>& trackData = scene.tracks[t];
+        trackData.stepCount = std::max(std::min((int)p[0], STEPS), 1);
+        trackData.divisionIndex = std::min((int)p[1], NUM_DIVISIONS - 1);
+        trackData.direction = (Direction)std::min((int)p[2], (int)DIR_RANDOM);
+        trackData.seed = getU32(p + 3);
+        int steps = std::min(blobSteps, STEPS);
+        const uint8_t* gates = p + 7;
+        const uint8_t* pitches = gates + (blobSteps + 7) / 8;
+        uint64_t gateMask = 0;
+        for (int i = 0; i < (steps + 7) / 8; i++) {
+            gateMask |= (uint64_t)gates[i] << (8 * i);
+        }
+        uint64_t active = firstSteps(steps);
+        trackData.gates = (typename TrackDataT<STEPS>::StepMask)((trackData.gates & ~active) | (gateMask & active));
+        for (int s = 0; s < steps; s++) {
+            int bit = s * 12;
+            uint32_t word = (uint32_t)pitches[bit / 8] | (uint32_t)pitches[bit / 8 + 1] << 8;
+            trackData.pitches[s] = (uint16_t)((word >> (bit % 8)) & PITCH_CODE_MAX);
+        }
+        p += blobTrackSize;
+    }
+    return true;
+}
+
+// Reflected CRC-32 (IEEE 802.3, as used by zlib and PNG)
+struct Crc32Table {
+    uint32_t entries[256];
+
+    Crc32Table() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            entries[i] = c;
+        }
+    }
+};
+
+uint32_t crc32(const uint8_t* data, size_t size) {
+    static const Crc32Table table;
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++) {
+        c = table.entries[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
+
+static const char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+std::string toBase64(const uint8_t* data, size_t size) {
+    std::string text;
+    text.reserve((size + 2) / 3 * 4);
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t group = (uint32_t)data[i] << 16;
+        if (i + 1 < size)
+            group |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < size)
+            group |= data[i + 2];
+        text += BASE64_ALPHABET[group >> 18];
+        text += BASE64_ALPHABET[(group >> 12) & 63];
+        text += i + 1 < size ? BASE64_ALPHABET[(group >> 6) & 63] : '=';
+        text += i + 2 < size ? BASE64_ALPHABET[group & 63] : '=';
+    }
+    return text;
+}
+
+bool fromBase64(const char* text, std::vector<uint8_t>& data) {
+    data.clear();
+    uint32_t group = 0;
+    int bits = 0;
+    for (const char* c = text; *c && *c != '='; c++) {
+        const char* found = std::strchr(BASE64_ALPHABET, *c);
+        if (!found)
+            return false;
+        group = group << 6 | (uint32_t)(found - BASE64_ALPHABET);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            data.push_back((uint8_t)(group >> bits));
+        }
+    }
+    return true;
+}
+
+// Engine sizes in use, see SequencerCore.hpp
+template struct SceneBlobT<3, 8>;
+template struct SceneBlobT<4, 16>;
+template struct SceneBlobT<8, 64>;
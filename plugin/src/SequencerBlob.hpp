@@ -0,0 +1,36 @@
+#pragma once
+// Packed binary scene format, for patch storage and the hardware's flash.
+//
+// One scene per blob, little-endian, version 1:
+//   "SQ", version, track count, step count, flags (bit 0: empty scene)
+//   per track: step count, division index, direction, seed (u32),
+//              gate bitmask (1 bit per step, LSB first),
+//              pitch codes (12 bits per step, packed LSB first)
+//   CRC-32 of everything before it
+// Pitches are stored as 12-bit DAC codes over 0-5 V (REQUIREMENTS.md).
+// Blobs from other engine sizes load the tracks and steps both sizes have.
+#include "SequencerCore.hpp"
+#include <string>
+#include <vector>
+
+static const int SCENE_BLOB_VERSION = 1;
+
+template <int TRACKS, int STEPS>
+struct SceneBlobT {
+    static const size_t HEADER_SIZE = 6;
+    static const size_t TRACK_SIZE = 7 + (STEPS + 7) / 8 + (STEPS * 12 + 7) / 8;
+    static const size_t SIZE = HEADER_SIZE + TRACKS * TRACK_SIZE + 4;
+
+    uint8_t bytes[SIZE];
+
+    void encode(const SceneDataT<TRACKS, STEPS>& scene);
+    // Returns false, leaving the scene untouched, if the data is not a
+    // valid blob of a known version
+    static bool decode(const uint8_t* data, size_t size, SceneDataT<TRACKS, STEPS>& scene);
+};
+
+uint32_t crc32(const uint8_t* data, size_t size);
+
+std::string toBase64(const uint8_t* data, size_t size);
+// Returns false on characters outside the base64 alphabet
+bool fromBase64(const char* text, std::vector<uint8_t>& data);
@@ -0,0 +1,1025 @@
+#include "SequencerCore.hpp"
+#include "SceneHistory.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <thread>
+
+// Upper bound for quiet runs, well below INT_MAX so sums cannot overflow
+static const int MAX_QUIET = 1 << 30;
+
+// Scale between a 0.64 fixed-point beat phase and beats
+static const double PHASE_SCALE = 18446744073709551616.0;
+
+// Same argument order and semantics as rack::clamp()
+template <typename T>
+static T clampValue(T x, T lo, T hi) {
+    return std::max(std::min(x, hi), lo);
+}
+
+// Sub-step of a beat divided into `steps` parts at a 0.64 fixed-point phase
+static int subStepAt(uint64_t phase, int steps) {
+    return (int)(((phase >> 32) * (uint64_t)steps) >> 32);
+}
+
+// First phase at which subStepAt() reaches `subStep`
+static uint64_t subStepPhase(int subStep, int steps) {
+    return (((uint64_t)subStep << 32) + (uint64_t)steps - 1) / (uint64_t)steps << 32;
+}
+
+// Samples to run before the sample on which a phase accumulator reaches
+// `target` (or wraps, for target 0)
+static int64_t samplesUntilPhase(uint64_t phase, uint64_t increment, uint64_t target) {
+    if (target != 0 && phase >= target)
+        return 0;
+    if (increment == 0)
+        return MAX_QUIET;
+    return (int64_t)std::min((target - phase - 1) / increment, (uint64_t)MAX_QUIET);
+}
+
+// SplitMix64 output function: a well-mixed value for any input, used as a
+// counter-based generator
+static uint64_t mixBits(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// Undo history keys. Repeated edits of one field of one track share a
+// level; whole-scene edits and gate toggles each get their own (key 0).
+enum EditKind {
+    EDIT_PITCH = 1,
+    EDIT_SETTINGS,
+    EDIT_SEEDS
+};
+
+static uint32_t editKey(EditKind kind, int scene, int t, int s) {
+    return (uint32_t)kind << 28 | (uint32_t)scene << 20 | (uint32_t)t << 12 | (uint32_t)s;
+}
+
+int pitchToCode(float volts) {
+    int code = (int)std::lround(volts * (PITCH_CODE_MAX / PITCH_CODE_VOLTS));
+    return std::max(std::min(code, PITCH_CODE_MAX), 0);
+}
+
+float codeToPitch(int code) {
+    return code * (PITCH_CODE_VOLTS / PITCH_CODE_MAX);
+}
+
+// Highest note in the DAC range, in semitones above 0 V
+static const int MAX_NOTE = (int)(PITCH_CODE_VOLTS * 12);
+
+// Lowest note of a scale above `note` (in semitones above 0 V), or -1 if
+// there is none in the DAC range
+static int nextScaleNote(const Quantizer& quantizer, int note) {
+    for (int n = note + 1; n <= MAX_NOTE; n++) {
+        if ((quantizer.scale >> ((n + 12 - quantizer.root) % 12)) & 1)
+            return n;
+    }
+    return -1;
+}
+
+void* CacheAligned::operator new(size_t size) {
+    // Over-allocate and keep the pointer malloc() returned just before the
+    // aligned block, where operator delete finds it
+    void* raw = std::malloc(size + CACHE_LINE + sizeof(void*));
+    if (!raw)
+        throw std::bad_alloc();
+    uintptr_t aligned = ((uintptr_t)raw + sizeof(void*) + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1);
+    ((void**)aligned)[-1] = raw;
+    return (void*)aligned;
+}
+
+void CacheAligned::operator delete(void* p) {
+    if (p)
+        std::free(((void**)p)[-1]);
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+SequencerEngine<TRACKS, STEPS, SCENES>::SequencerEngine() {
+    for (int l = 0; l < LANES; l++) {
+        lanes.cycleBeat[l] = 0;
+        lanes.cycleStep[l] = 1;
+        lanes.gateEnd[l] = 0;
+        lanes.swingGateAt[l] = INT64_MAX;
+        lanes.pitch[l] = 0.f;
+    }
+    for (int t = 0; t < NUM_TRACKS; t++) {
+        orderLength[t] = 1;
+        orderSteps[t] = 0;
+        outputVolts0[t] = 0.f;
+        outputGain[t] = 1.f;
+        buildPitchTable(t);
+    }
+    // Initialize first scene
+    scenes[0].isEmpty = false;
+    syncLanes();
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::calibrateOutput(int t, float volts0, float voltsMax) {
+    outputVolts0[t] = volts0;
+    outputGain[t] = (voltsMax - volts0) / PITCH_CODE_VOLTS;
+    buildPitchTable(t);
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::setQuantizer(int t, int scale, int root) {
+    Quantizer& quantizer = quantizers[t];
+    scale &= SCALE_ALL_NOTES;
+    root = ((root % 12) + 12) % 12;
+    if (quantizer.scale == scale && quantizer.root == root)
+        return;
+    quantizer.scale = (uint16_t)scale;
+    quantizer.root = root;
+    buildPitchTable(t);
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::buildPitchTable(int t) {
+    const Quantizer& quantizer = quantizers[t];
+    float volts0 = outputVolts0[t];
+    float gain = outputGain[t];
+    if (quantizer.scale == 0) {
+        for (int code = 0; code <= PITCH_CODE_MAX; code++) {
+            pitchTable[t][code] = volts0 + codeToPitch(code) * gain;
+        }
+    } else {
+        // Codes rise through the range, so one pass moves to the next note
+        // whenever a code is past the midpoint between two notes. Every
+        // octave holds a note of the scale, so there is always a first one.
+        int note = nextScaleNote(quantizer, -1);
+        int next = nextScaleNote(quantizer, note);
+        for (int code = 0; code <= PITCH_CODE_MAX; code++) {
+            float semitones = codeToPitch(code) * 12.f;
+            while (next >= 0 && semitones > 0.5f * (note + next)) {
+                note = next;
+                next = nextScaleNote(quantizer, note);
+            }
+            pitchTable[t][code] = volts0 + note / 12.f * gain;
+        }
+    }
+    lanes.pitch[t] = pitchVolts(t, scenes[currentScene].tracks[t].pitches[outputStep[t]]);
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::clear() {
+    for (int i = 0; i < NUM_SCENES; i++) {
+        scenes[i] = SceneData();
+        touchScene(i);
+    }
+    if (history)
+        history->clear();
+    scenes[0].isEmpty = false;
+    currentScene = 0;
+    copySourceScene = -1;
+    deleteMode = false;
+    for (int t = 0; t < NUM_TRACKS; t++) {
+        currentStep[t] = 0;
+        orderIndex[t] = 0;
+        stepCounter[t] = 0;
+        lanes.cycleBeat[t] = 0;
+        lanes.cycleStep[t] = 1;
+        lanes.swingGateAt[t] = INT64_MAX;
+        setQuantizer(t, 0, 0);
+        lanes.pitch[t] = pitchVolts(t, 0);
+        swingGateLength[t] = 0;
+        stepParity[t] = 0;
+        pendingSwingStep[t] = 0;
+        outputStep[t] = 0;
+    }
+    syncLanes();
+    isRunning = true;
+    lockSeed = false;
+    randomSeed = mixBits(randomSeed);
+    clockSmoothing = DEFAULT_CLOCK_SMOOTHING;
+    internalClockPhase = 0;
+    lastClockSample = sampleCount;
+    pllPhase = 0;
+    pllIncrement = 0;
+    pllLocked = false;
+    edgeBeat = 0;
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::loadState(const PatchState& state) {
+    for (int i = 0; i < NUM_SCENES; i++) {
+        scenes[i] = state.scenes[i];
+        touchScene(i);
+    }
+    if (history)
+        history->clear();
+    currentScene = clampValue(state.currentScene, 0, NUM_SCENES - 1);
+    isRunning = state.isRunning;
+    lockSeed = state.lockSeed;
+    copySourceScene = -1;
+    deleteMode = false;
+    syncLanes();
+    for (int t = 0; t < NUM_TRACKS; t++) {
+        setQuantizer(t, state.quantizers[t].scale, state.quantizers[t].root);
+    }
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+typename SequencerEngine<TRACKS, STEPS, SCENES>::PatchState* SequencerEngine<TRACKS, STEPS, SCENES>::postState(PatchState* state) {
+    PatchState* previous = postedState;
+    if (previous && pendingState.exchange(nullptr, std::memory_order_acq_rel) != previous) {
+        // Taken by the audio thread, which hands it back when it has
+        // finished copying it
+        while (loadedState.load(std::memory_order_acquire) != previous)
+            std::this_thread::yield();
+    }
+    loadedState.store(nullptr, std::memory_order_relaxed);
+    postedState = state;
+    if (state)
+        pendingState.store(state, std::memory_order_release);
+    return previous;
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+bool SequencerEngine<TRACKS, STEPS, SCENES>::applyPendingSlow() {
+    bool changed = false;
+    if (pendingState.load(std::memory_order_relaxed)) {
+        PatchState* state = pendingState.exchange(nullptr, std::memory_order_acquire);
+        if (state) {
+            loadState(*state);
+            loadedState.store(state, std::memory_order_release);
+            changed = true;
+        }
+    }
+    if (!commands.empty()) {
+        Command command;
+        while (commands.pop(command)) {
+            changed |= applyCommand(command);
+        }
+    }
+    return changed;
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+bool SequencerEngine<TRACKS, STEPS, SCENES>::applyCommand(const Command& command) {
+    int t = clampValue(command.track, 0, NUM_TRACKS - 1);
+    int s = clampValue(command.step, 0, NUM_STEPS - 1);
+    switch (command.type) {
+        case CMD_SET_PITCH:
+            setPitch(t, s, command.pitch);
+            return true;
+        case CMD_TOGGLE_GATE:
+            toggleGate(t, s);
+            return true;
+        case CMD_SET_TRACK_SETTINGS:
+            setTrackSettings(t, clampValue(command.stepCount, 1, NUM_STEPS),
+                clampValue(command.divisionIndex, 0, NUM_DIVISIONS - 1),
+                (Direction)clampValue((int)command.direction, (int)DIR_FORWARD, (int)DIR_RANDOM));
+            return true;
+        case CMD_SET_SEED:
+            setSeed(t, command.seed);
+            return false;
+        case CMD_SET_LOCK_SEED:
+            lockSeed = command.on;
+            return false;
+        case CMD_PRESS_SCENE:
+            return pressScene(clampValue(command.scene, 0, NUM_SCENES - 1));
+        case CMD_ROTATE_GATES:
+            rotateGates(t, command.amount);
+            return true;
+        case CMD_INVERT_GATES:
+            invertGates(t);
+            return true;
+        case CMD_EUCLID_GATES:
+            fillEuclid(t, command.amount);
+            return true;
+        case CMD_SET_QUANTIZER:
+            setQuantizer(t, command.scale, command.root);
+            return false;
+        case CMD_SET_CLOCK_SMOOTHING:
+            if (command.smoothing >= 0.f && command.smoothing < 1.f)
+                clockSmoothing = command.smoothing;
+            return false;
+        case CMD_UNDO:
+            return undo();
+        case CMD_REDO:
+            return redo();
+    }
+    return false;
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::resetPlayback() {
+    for (int t = 0; t < NUM_TRACKS; t++) {
+        orderIndex[t] = 0;
+        currentStep[t] = stepOrder[t][0];
+        stepCounter[t] = 0;
+        stepParity[t] = 0;
+        lanes.cycleBeat[t] = 0;
+        lanes.cycleStep[t] = 1;
+    }
+    syncLanes();
+    if (!lockSeed)
+        randomSeed = mixBits(randomSeed);
+    internalClockPhase = 0;
+    resetOutputPulse.trigger(sampleCount, msToSamples(1.f));
+    resetCount++;
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::seek(int64_t beat, double beatFraction) {
+    beat = std::max(beat, (int64_t)0);
+    double scaled = clampValue(beatFraction, 0.0, 1.0) * PHASE_SCALE;
+    uint64_t phase = scaled < PHASE_SCALE ? (uint64_t)scaled : UINT64_MAX;
+    internalClockPhase = phase;
+    pllPhase = phase;
+
+    for (int t = 0; t < NUM_TRACKS; t++) {
+        // Position in the ratio cycle, as process() counts it
+        int clocks = lanes.ratioClocks[t];
+        int steps = lanes.ratioSteps[t];
+        int64_t cycle = beat / clocks;
+        int cycleBeat = (int)(beat % clocks);
+        int tick = cycleBeat * steps + subStepAt(phase, steps);
+        lanes.cycleBeat[t] = cycleBeat;
+        lanes.cycleStep[t] = tick / clocks + 1;
+
+        // Every full cycle plays `steps` steps; the reset step is not counted
+        uint64_t played = (uint64_t)cycle * steps + lanes.cycleStep[t] - 1;
+        stepCounter[t] = played;
+        stepParity[t] = (int)(played % 2);
+        if (orderDirection[t] == DIR_RANDOM)
+            orderIndex[t] = played > 0 ? randomIndex(t, played) : 0;
+        else
+            orderIndex[t] = (int)(played % orderLength[t]);
+        currentStep[t] = stepOrder[t][orderIndex[t]];
+
+        const TrackData& trackData = scenes[currentScene].tracks[t];
+        lanes.gateEnd[t] = std::min(lanes.gateEnd[t], sampleCount);
+        lanes.swingGateAt[t] = INT64_MAX;
+        lanes.pitch[t] = pitchVolts(t, trackData.pitches[currentStep[t]]);
+        lanes.heldGate[t] = trackData.gate(currentStep[t]);
+        outputStep[t] = currentStep[t];
+    }
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::toggleRun() {
+    isRunning = !isRunning;
+    if (isRunning) {
+        // Clock interval measurement resumes where it stopped
+        lastClockSample += sampleCount - stoppedAtSample;
+    } else {
+        stoppedAtSample = sampleCount;
+    }
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::pressCopy() {
+    deleteMode = false;
+    copySourceScene = (copySourceScene < 0) ? currentScene : -1;
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::pressDelete() {
+    copySourceScene = -1;
+    deleteMode = !deleteMode;
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+bool SequencerEngine<TRACKS, STEPS, SCENES>::pressScene(int s) {
+    bool changed = switchScene(s);
+    syncLanes();
+    return changed;
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+bool SequencerEngine<TRACKS, STEPS, SCENES>::switchScene(int s) {
+    if (copySourceScene >= 0) {
+        recordEdit(s, 0);
+        scenes[s] = scenes[copySourceScene];
+        scenes[s].isEmpty = false;
+        touchScene(s);
+        copySourceScene = -1;
+        currentScene = s;
+        return true;
+    }
+    if (deleteMode && s != 0) {
+        recordEdit(s, 0);
+        scenes[s] = SceneData();
+        touchScene(s);
+        deleteMode = false;
+        if (currentScene == s) {
+            currentScene = 0;
+            return true;
+        }
+        return false;
+    }
+    if (scenes[s].isEmpty) {
+        recordEdit(s, 0);
+        scenes[s] = scenes[currentScene];
+        scenes[s].isEmpty = false;
+        touchScene(s);
+    }
+    currentScene = s;
+    return true;
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::toggleGate(int t, int s) {
+    recordEdit(currentScene, 0);
+    TrackData& trackData = track(t);
+    trackData.gates ^= (typename TrackData::StepMask)stepBit(s);
+    touchScene(currentScene);
+    syncTrack(t);
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::setPitch(int t, int s, int code) {
+    TrackData& trackData = track(t);
+    uint16_t pitch = (uint16_t)clampValue(code, 0, PITCH_CODE_MAX);
+    if (trackData.pitches[s] != pitch) {
+        recordEdit(currentScene, editKey(EDIT_PITCH, currentScene, t, s));
+        trackData.pitches[s] = pitch;
+        touchScene(currentScene);
+    }
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::rotateGates(int t, int amount) {
+    TrackData& trackData = track(t);
+    setGates(t, rotateSteps(trackData.gates, clampValue(trackData.stepCount, 1, NUM_STEPS), amount));
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::invertGates(int t) {
+    TrackData& trackData = track(t);
+    setGates(t, trackData.gates ^ firstSteps(clampValue(trackData.stepCount, 1, NUM_STEPS)));
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::fillEuclid(int t, int pulses) {
+    TrackData& trackData = track(t);
+    int n = clampValue(trackData.stepCount, 1, NUM_STEPS);
+    uint64_t active = firstSteps(n);
+    setGates(t, (trackData.gates & ~active) | euclidSteps(clampValue(pulses, 0, n), n));
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::setGates(int t, uint64_t gates) {
+    TrackData& trackData = track(t);
+    typename TrackData::StepMask mask = (typename TrackData::StepMask)gates;
+    if (trackData.gates != mask) {
+        recordEdit(currentScene, 0);
+        trackData.gates = mask;
+        touchScene(currentScene);
+        syncTrack(t);
+    }
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::setSeed(int t, uint32_t seed) {
+    TrackData& trackData = track(t);
+    if (trackData.seed != seed) {
+        // All tracks reseeded together undo as one
+        recordEdit(currentScene, editKey(EDIT_SEEDS, currentScene, 0, 0));
+        trackData.seed = seed;
+        touchScene(currentScene);
+    }
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::setTrackSettings(int t, int stepCount, int divisionIndex, Direction direction) {
+    TrackData& trackData = track(t);
+    if (trackData.stepCount != stepCount || trackData.divisionIndex != divisionIndex || trackData.direction != direction) {
+        recordEdit(currentScene, editKey(EDIT_SETTINGS, currentScene, t, 0));
+        trackData.stepCount = stepCount;
+        trackData.divisionIndex = divisionIndex;
+        trackData.direction = direction;
+        touchScene(currentScene);
+    }
+    syncTrack(t);
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::recordEdit(int s, uint32_t key) {
+    if (history)
+        history->record(s, key, scenes[s]);
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+bool SequencerEngine<TRACKS, STEPS, SCENES>::undo() {
+    return restoredScene(history ? history->undo(scenes) : -1);
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+bool SequencerEngine<TRACKS, STEPS, SCENES>::redo() {
+    return restoredScene(history ? history->redo(scenes) : -1);
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+bool SequencerEngine<TRACKS, STEPS, SCENES>::restoredScene(int s) {
+    if (s < 0)
+        return false;
+    touchScene(s);
+    copySourceScene = -1;
+    deleteMode = false;
+    if (s != currentScene)
+        return false;
+    // Undoing the first use of a scene empties it again
+    if (scenes[currentScene].isEmpty)
+        currentScene = 0;
+    syncLanes();
+    return true;
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::syncTrack(int t) {
+    const TrackData& trackData = scenes[currentScene].tracks[t];
+    int steps = clampValue(trackData.stepCount, 1, NUM_STEPS);
+    if (steps != orderSteps[t] || trackData.direction != orderDirection[t])
+        buildStepOrder(t, steps, trackData.direction);
+    const ClockRatio& ratio = DIVISIONS[clampValue(trackData.divisionIndex, 0, NUM_DIVISIONS - 1)];
+    lanes.ratioClocks[t] = ratio.clocks;
+    lanes.ratioSteps[t] = ratio.steps;
+    lanes.heldGate[t] = trackData.gate(currentStep[t]);
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::syncLanes() {
+    for (int t = 0; t < NUM_TRACKS; t++) {
+        syncTrack(t);
+    }
+    // Padding lanes never step
+    for (int l = NUM_TRACKS; l < LANES; l++) {
+        lanes.ratioClocks[l] = 0;
+        lanes.ratioSteps[l] = 0;
+        lanes.heldGate[l] = 0;
+    }
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+int64_t SequencerEngine<TRACKS, STEPS, SCENES>::msToSamples(float ms) const {
+    return std::max((int64_t)(ms * 0.001f * sampleRate + 0.5f), (int64_t)1);
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::updateInternalClock(const Inputs& in) {
+    if (in.bpm == internalClockBpm && in.sampleRate == internalClockRate)
+        return;
+    internalClockBpm = in.bpm;
+    internalClockRate = in.sampleRate;
+    // Beats per sample as a 0.64 fixed-point fraction
+    double beatsPerSample = (double)in.bpm / 60.0 / (double)in.sampleRate;
+    internalClockIncrement = (uint64_t)(beatsPerSample * PHASE_SCALE);
+    internalClockPeriod = (int64_t)(60.0 * in.sampleRate / in.bpm + 0.5);
+    pulseSamples = msToSamples(1.f);
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+bool SequencerEngine<TRACKS, STEPS, SCENES>::syncPll(int64_t now, float smoothing) {
+    int64_t sinceLastClock = now - lastClockSample;
+    // The first edge after switching to the external clock has no interval
+    bool valid = edgeBeat > 0 && sinceLastClock > sampleRate * 0.01f && sinceLastClock < sampleRate * 4.f;
+    edgeBeat++;
+
+    // Tempo: exponential average of the edge interval
+    if (valid && pllLocked) {
+        pllPeriod += (sinceLastClock - pllPeriod) * (1.0 - smoothing);
+    } else if (valid) {
+        pllPeriod = (double)sinceLastClock;
+    }
+    if (valid)
+        clockPeriodSamples = (int64_t)(pllPeriod + 0.5);
+
+    // Phase error in beats, positive when the PLL is behind the clock
+    double error = (double)(edgeBeat - pllBeat) - pllPhase / PHASE_SCALE;
+    bool hardSync = !pllLocked || smoothing <= 0.f || error > 0.5;
+    pllLocked = valid;
+
+    // Without smoothing the PLL never starts a beat on its own, the edge does
+    double correction = 1.0;
+    if (hardSync) {
+        pllBeat = edgeBeat;
+        pllPhase = 0;
+    } else {
+        // Make up the error over the next beat instead of jumping
+        correction = clampValue(1.0 + error * (1.0 - smoothing), 0.5, 2.0);
+    }
+    // Without a measured period (first edge, or after a pause) the PLL
+    // waits at the start of the beat for the next edge instead of guessing
+    pllIncrement = valid ? (uint64_t)(PHASE_SCALE / pllPeriod * correction) : 0;
+    return hardSync ? true : advancePll();
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+bool SequencerEngine<TRACKS, STEPS, SCENES>::advancePll() {
+    uint64_t next = pllPhase + pllIncrement;
+    if (next >= pllPhase) {
+        pllPhase = next;
+        return false;
+    }
+    if (pllBeat < edgeBeat) {
+        pllBeat++;
+        pllPhase = next;
+        return true;
+    }
+    // Ahead of the clock (late edge or stopped clock): hold at the end of
+    // the beat until the next edge arrives
+    pllPhase = UINT64_MAX;
+    return false;
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+int64_t SequencerEngine<TRACKS, STEPS, SCENES>::gateSamples(int64_t stepSamples, int64_t delaySamples, float pulseWidth) const {
+    int64_t samples = (int64_t)(stepSamples * pulseWidth);
+    // A delayed gate still ends before the next step starts
+    return clampValue(samples, pulseSamples, (int64_t)((stepSamples - delaySamples) * 0.95f));
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+int SequencerEngine<TRACKS, STEPS, SCENES>::randomIndex(int t, uint64_t n) const {
+    uint64_t key = (uint64_t)scenes[currentScene].tracks[t].seed << 32 | (uint64_t)t;
+    if (!lockSeed)
+        key ^= randomSeed;
+    uint64_t bits = mixBits(mixBits(key) + n);
+    // Scale the top 32 bits to the order length
+    return (int)(((bits >> 32) * (uint64_t)orderLength[t]) >> 32);
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::buildStepOrder(int t, int steps, Direction direction) {
+    uint8_t* order = stepOrder[t];
+    int oldLength = orderLength[t];
+    int n = 0;
+    switch (direction) {
+        case DIR_REVERSE:
+            // Starts on the reset step like the other orders
+            order[n++] = 0;
+            for (int s = steps - 1; s > 0; s--)
+                order[n++] = s;
+            break;
+        case DIR_PENDULUM:
+            // End steps play once per swing
+            for (int s = 0; s < steps; s++)
+                order[n++] = s;
+            for (int s = steps - 2; s > 0; s--)
+                order[n++] = s;
+            break;
+        case DIR_FORWARD:
+        case DIR_RANDOM:
+            // Random picks entries of the forward order
+            for (int s = 0; s < steps; s++)
+                order[n++] = s;
+            break;
+    }
+    orderLength[t] = n;
+    orderSteps[t] = steps;
+    orderDirection[t] = direction;
+
+    // Carry on from the step playing now, searching from the same relative
+    // position so a pendulum keeps its direction. If the new order does not
+    // hold the step, the next step starts the order over.
+    int start = orderIndex[t] * n / oldLength;
+    orderIndex[t] = n - 1;
+    for (int k = 0; k < n; k++) {
+        int i = (start + k) % n;
+        if (order[i] == currentStep[t]) {
+            orderIndex[t] = i;
+            break;
+        }
+    }
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::advanceStep(int track) {
+    stepCounter[track]++;
+    int next = orderIndex[track] + 1;
+    next = next < orderLength[track] ? next : 0;
+    if (orderDirection[track] == DIR_RANDOM)
+        next = randomIndex(track, stepCounter[track]);
+    orderIndex[track] = next;
+    currentStep[track] = stepOrder[track][next];
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::stepTrack(int t, int64_t now, const Inputs& in) {
+    TrackData& trackData = scenes[currentScene].tracks[t];
+    advanceStep(t);
+    lanes.heldGate[t] = trackData.gate(currentStep[t]);
+    stepParity[t] = (stepParity[t] + 1) % 2;
+
+    // Swing delays every second step by a fraction of its own length
+    int64_t stepSamples = clockPeriodSamples * lanes.ratioClocks[t] / lanes.ratioSteps[t];
+    int64_t swingDelay = 0;
+    if (stepParity[t] == 1 && in.swing > 0.f) {
+        swingDelay = (int64_t)(stepSamples * in.swing * 0.5f);
+    }
+    bool swung = swingDelay > pulseSamples;
+    // A swung gate still pending from a step cut short is dropped
+    lanes.swingGateAt[t] = INT64_MAX;
+
+    if (trackData.gate(currentStep[t])) {
+        if (swung) {
+            lanes.swingGateAt[t] = now + swingDelay;
+            swingGateLength[t] = gateSamples(stepSamples, swingDelay, in.pulseWidth);
+            pendingSwingStep[t] = currentStep[t];
+        } else {
+            lanes.gateEnd[t] = std::max(lanes.gateEnd[t], now + gateSamples(stepSamples, 0, in.pulseWidth));
+            gateCount[t]++;
+            lanes.pitch[t] = pitchVolts(t, trackData.pitches[currentStep[t]]);
+            outputStep[t] = currentStep[t];
+        }
+    } else {
+        if (!swung) {
+            lanes.pitch[t] = pitchVolts(t, trackData.pitches[currentStep[t]]);
+            outputStep[t] = currentStep[t];
+        }
+    }
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::fireSwungGate(int t, int64_t now) {
+    lanes.gateEnd[t] = std::max(lanes.gateEnd[t], now + swingGateLength[t]);
+    gateCount[t]++;
+    lanes.pitch[t] = pitchVolts(t, scenes[currentScene].tracks[t].pitches[pendingSwingStep[t]]);
+    outputStep[t] = pendingSwingStep[t];
+    lanes.swingGateAt[t] = INT64_MAX;
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::process(const Inputs& in, Outputs& out) {
+    bool loaded = applyPending();
+    processSample(in, out);
+    out.sceneChanged |= loaded;
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::processSample(const Inputs& in, Outputs& out) {
+    out.sceneChanged = false;
+    sampleRate = in.sampleRate;
+    int64_t now = sampleCount;
+
+    // Handle reset
+    if (resetTrigger.process(in.reset)) {
+        resetPlayback();
+    }
+    out.reset = resetOutputPulse.isHigh(now);
+
+    // Handle scene CV input
+    if (in.sceneCvConnected) {
+        int newScene = clampValue((int)in.sceneCv, 0, NUM_SCENES - 1);
+        if (newScene != currentScene && !scenes[newScene].isEmpty) {
+            currentScene = newScene;
+            syncLanes();
+            out.sceneChanged = true;
+        }
+    }
+
+    // Clock generation. Divided tracks count clock edges, multiplied tracks
+    // subdivide the beat phase (internal clock or external clock PLL).
+    bool clockRising = false;
+    bool beatStart = false;
+    updateInternalClock(in);
+    if (!in.clockConnected || clockPeriodSamples <= 0) {
+        clockPeriodSamples = internalClockPeriod;
+    }
+
+    if (isRunning) {
+        if (!in.clockConnected) {
+            internalClockPhase += internalClockIncrement;
+            if (internalClockPhase < internalClockIncrement) {
+                clockRising = true;
+            }
+            beatStart = clockRising;
+            pllLocked = false;
+            edgeBeat = 0;
+        } else {
+            clockRising = clockTrigger.process(in.clock);
+            beatStart = clockRising ? syncPll(now, clockSmoothing) : advancePll();
+        }
+        if (clockRising) {
+            lastClockSample = now;
+            clockOutputPulse.trigger(now, pulseSamples);
+        }
+    }
+    out.clock = clockOutputPulse.isHigh(now);
+    uint64_t beatPhase = in.clockConnected ? pllPhase : internalClockPhase;
+
+    // Step scheduling, branch-free over all lanes so it vectorizes. Only
+    // the tracks that are due take the scalar step path below. Divided
+    // tracks (one step every `clocks` beats) count the clock edges
+    // themselves, so their steps land on the edges; tracks with steps
+    // inside the beat count the beats of the phase they subdivide.
+    int32_t edgeCount = clockRising ? 1 : 0;
+    int32_t beatCount = beatStart ? 1 : 0;
+    int32_t running = isRunning ? 1 : 0;
+    uint64_t phaseHigh = beatPhase >> 32;
+    int32_t ticks[LANES];
+    int32_t due[LANES];
+    for (int l = 0; l < LANES; l++) {
+        int32_t count = lanes.ratioSteps[l] == 1 ? edgeCount : beatCount;
+        int32_t beat = lanes.cycleBeat[l] + count;
+        bool wrap = count & (beat >= lanes.ratioClocks[l]);
+        lanes.cycleBeat[l] = wrap ? 0 : beat;
+        lanes.cycleStep[l] = wrap ? 0 : lanes.cycleStep[l];
+        // Same as subStepAt(beatPhase, steps)
+        int32_t subStep = (int32_t)((phaseHigh * (uint32_t)lanes.ratioSteps[l]) >> 32);
+        ticks[l] = lanes.cycleBeat[l] * lanes.ratioSteps[l] + subStep;
+        // Only divide once the next step's tick has been reached
+        due[l] = running & (lanes.cycleStep[l] < lanes.ratioSteps[l]) & (ticks[l] >= lanes.cycleStep[l] * lanes.ratioClocks[l]);
+    }
+
+    for (int t = 0; t < NUM_TRACKS; t++) {
+        if (due[t]) {
+            lanes.cycleStep[t] = ticks[t] / lanes.ratioClocks[t] + 1;
+            stepTrack(t, now, in);
+        }
+        if (now >= lanes.swingGateAt[t])
+            fireSwungGate(t, now);
+    }
+
+    // Outputs
+    for (int t = 0; t < NUM_TRACKS; t++) {
+        out.pitch[t] = lanes.pitch[t];
+        out.gate[t] = isRunning ? now < lanes.gateEnd[t] : lanes.heldGate[t] != 0;
+    }
+    out.sceneCv = (float)currentScene;
+
+    sampleCount++;
+}
+
+// How many of the next n samples pass through a copy of `trigger` without
+// firing. A null buffer means the input is held at `value`.
+static int quietTriggerSamples(EdgeTrigger trigger, const float* buffer, float value, int n) {
+    if (!buffer)
+        return trigger.process(value) ? 0 : n;
+    for (int k = 0; k < n; k++) {
+        if (trigger.process(buffer[k]))
+            return k;
+    }
+    return n;
+}
+
+static void advanceTrigger(EdgeTrigger& trigger, const float* buffer, float value, int n) {
+    if (!buffer) {
+        if (n > 0)
+            trigger.process(value);
+        return;
+    }
+    for (int k = 0; k < n; k++) {
+        trigger.process(buffer[k]);
+    }
+}
+
+static void fillRun(float* buffer, float value, int n) {
+    if (buffer)
+        std::fill(buffer, buffer + n, value);
+}
+
+// Converts a sample distance to a quiet-run length without overflowing int
+static int quietLength(int64_t samples) {
+    return (int)std::max(std::min(samples, (int64_t)MAX_QUIET), (int64_t)0);
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+int SequencerEngine<TRACKS, STEPS, SCENES>::quietSamples(const Inputs& in) {
+    int64_t now = sampleCount;
+    int n = MAX_QUIET;
+    uint64_t beatPhase = in.clockConnected ? pllPhase : internalClockPhase;
+    uint64_t beatIncrement = in.clockConnected ? pllIncrement : internalClockIncrement;
+
+    // Clock and reset output pulse ends
+    if (resetOutputPulse.isHigh(now))
+        n = std::min(n, quietLength(resetOutputPulse.endSample - now));
+    if (clockOutputPulse.isHigh(now))
+        n = std::min(n, quietLength(clockOutputPulse.endSample - now));
+
+    for (int t = 0; t < NUM_TRACKS; t++) {
+        // Swung gate
+        n = std::min(n, quietLength(lanes.swingGateAt[t] - now));
+
+        if (!isRunning)
+            continue;
+
+        // Gate-off
+        if (now < lanes.gateEnd[t])
+            n = std::min(n, quietLength(lanes.gateEnd[t] - now));
+
+        // Next step if it falls inside the current beat; later ones start
+        // on a beat phase wrap. A step already due (ratio just edited) is
+        // an event right away.
+        int clocks = lanes.ratioClocks[t];
+        int steps = lanes.ratioSteps[t];
+        if (lanes.cycleStep[t] < steps) {
+            int subStep = lanes.cycleStep[t] * clocks - lanes.cycleBeat[t] * steps;
+            if (subStep <= 0)
+                n = 0;
+            else if (subStep < steps)
+                n = std::min(n, quietLength(samplesUntilPhase(beatPhase, beatIncrement, subStepPhase(subStep, steps))));
+        }
+    }
+
+    // Beat phase wrap, unless the PLL is holding for the next clock edge
+    if (isRunning && (!in.clockConnected || pllBeat < edgeBeat))
+        n = std::min(n, quietLength(samplesUntilPhase(beatPhase, beatIncrement, 0)));
+
+    return n;
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+void SequencerEngine<TRACKS, STEPS, SCENES>::skipSamples(const Inputs& in, int n) {
+    sampleCount += n;
+    if (!in.clockConnected || clockPeriodSamples <= 0)
+        clockPeriodSamples = internalClockPeriod;
+
+    if (isRunning && !in.clockConnected) {
+        internalClockPhase += internalClockIncrement * (uint64_t)n;
+        pllLocked = false;
+        edgeBeat = 0;
+    } else if (isRunning) {
+        // A quiet run only reaches the end of the beat while the PLL holds
+        if (pllIncrement > 0 && (uint64_t)n > (UINT64_MAX - pllPhase) / pllIncrement)
+            pllPhase = UINT64_MAX;
+        else
+            pllPhase += pllIncrement * (uint64_t)n;
+    }
+}
+
+template <int TRACKS, int STEPS, int SCENES>
+bool SequencerEngine<TRACKS, STEPS, SCENES>::processBlock(const Inputs& in, const BlockInputs& blockIn, const BlockOutputs& blockOut, int frames) {
+    sampleRate = in.sampleRate;
+    updateInternalClock(in);
+    Inputs sampleIn = in;
+    Outputs out;
+    bool sceneChanged = applyPending();
+
+    int i = 0;
+    while (i < frames) {
+        int n = std::min(quietSamples(in), frames - i);
+
+        // Stop the run at the next edge on the clock, reset or scene CV ports
+        bool clockActive = isRunning && in.clockConnected;
+        if (n > 0)
+            n = quietTriggerSamples(resetTrigger, blockIn.reset ? blockIn.reset + i : nullptr, in.reset, n);
+        if (n > 0 && clockActive)
+            n = quietTriggerSamples(clockTrigger, blockIn.clock ? blockIn.clock + i : nullptr, in.clock, n);
+        if (n > 0 && in.sceneCvConnected) {
+            for (int k = 0; k < n; k++) {
+                float cv = blockIn.sceneCv ? blockIn.sceneCv[i + k] : in.sceneCv;
+                int newScene = clampValue((int)cv, 0, NUM_SCENES - 1);
+                if (newScene != currentScene && !scenes[newScene].isEmpty) {
+                    n = k;
+                    break;
+                }
+            }
+        }
+
+        if (n > 0) {
+            // Quiet run: outputs hold, timers jump ahead
+            for (int t = 0; t < NUM_TRACKS; t++) {
+                bool gateOn = isRunning ? sampleCount < lanes.gateEnd[t] : lanes.heldGate[t] != 0;
+                fillRun(blockOut.pitch[t] ? blockOut.pitch[t] + i : nullptr, lanes.pitch[t], n);
+                fillRun(blockOut.gate[t] ? blockOut.gate[t] + i : nullptr, gateOn ? 10.f : 0.f, n);
+            }
+            fillRun(blockOut.clock ? blockOut.clock + i : nullptr, clockOutputPulse.isHigh(sampleCount) ? 10.f : 0.f, n);
+            fillRun(blockOut.reset ? blockOut.reset + i : nullptr, resetOutputPulse.isHigh(sampleCount) ? 10.f : 0.f, n);
+            fillRun(blockOut.sceneCv ? blockOut.sceneCv + i : nullptr, (float)currentScene, n);
+
+            advanceTrigger(resetTrigger, blockIn.reset ? blockIn.reset + i : nullptr, in.reset, n);
+            if (clockActive)
+                advanceTrigger(clockTrigger, blockIn.clock ? blockIn.clock + i : nullptr, in.clock, n);
+            skipSamples(in, n);
+            i += n;
+            continue;
+        }
+
+        // Event sample: full per-sample path
+        if (blockIn.clock)
+            sampleIn.clock = blockIn.clock[i];
+        if (blockIn.reset)
+            sampleIn.reset = blockIn.reset[i];
+        if (blockIn.sceneCv)
+            sampleIn.sceneCv = blockIn.sceneCv[i];
+        processSample(sampleIn, out);
+        sceneChanged |= out.sceneChanged;
+
+        for (int t = 0; t < NUM_TRACKS; t++) {
+            if (blockOut.pitch[t])
+                blockOut.pitch[t][i] = out.pitch[t];
+            if (blockOut.gate[t])
+                blockOut.gate[t][i] = out.gate[t] ? 10.f : 0.f;
+        }
+        if (blockOut.clock)
+            blockOut.clock[i] = out.clock ? 10.f : 0.f;
+        if (blockOut.reset)
+            blockOut.reset[i] = out.reset ? 10.f : 0.f;
+        if (blockOut.sceneCv)
+            blockOut.sceneCv[i] = out.sceneCv;
+        i++;
+    }
+    return sceneChanged;
+}
+
+// Engine sizes in use, see SequencerCore.hpp
+template struct SequencerEngine<3, 8, 8>;
+template struct SequencerEngine<4, 16, 16>;
+template struct SequencerEngine<8, 64, 32>;
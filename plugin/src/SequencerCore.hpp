@@ -0,0 +1,558 @@
+#pragma once
+#include "LockFree.hpp"
+#include "StepMask.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Rack-independent sequencing engine. Everything in here is plain C++ so it
+// can be driven headless (benchmarks, offline renders) and shared with the
+// STM32 firmware. The Rack module in Sequencer.cpp is a thin adapter on top.
+
+// The engine is a template over its track, step and scene counts so
+// sibling models share one implementation while every loop and array is
+// sized at compile time. Sizes in use are instantiated in SequencerCore.cpp.
+
+// Clock division ratios (assuming clock = quarter note): a step lasts
+// clocks/steps clock pulses. Kept as integers so triplets and polyrhythms
+// land exactly on the clock every `clocks` pulses instead of drifting.
+struct ClockRatio {
+    int clocks;
+    int steps;
+    const char* name;
+};
+
+static const ClockRatio DIVISIONS[] = {
+    {4, 1, "1/1"},    // Whole note - 4 clocks per step
+    {2, 1, "1/2"},    // Half note - 2 clocks per step
+    {1, 1, "1/4"},    // Quarter note - 1 clock per step
+    {1, 2, "1/8"},    // Eighth note - 2 steps per clock
+    {1, 3, "1/8T"},   // Eighth triplet - 3 steps per clock
+    {1, 4, "1/16"},   // Sixteenth note - 4 steps per clock
+    {1, 6, "1/16T"},  // Sixteenth triplet - 6 steps per clock
+    {1, 8, "1/32"},   // Thirty-second note - 8 steps per clock
+    // Polyrhythmic ratios, appended so saved division indices keep their meaning
+    {3, 2, "3/2"},    // Dotted quarter - 2 steps every 3 clocks
+    {2, 3, "2/3"},    // Quarter triplet - 3 steps every 2 clocks
+    {3, 4, "3/4"},    // Dotted eighth - 4 steps every 3 clocks
+    {5, 4, "5/4"},    // 4 steps every 5 clocks
+    {4, 5, "4/5"},    // 5 steps every 4 clocks
+    {5, 8, "5/8"},    // 8 steps every 5 clocks
+    {7, 8, "7/8"},    // 8 steps every 7 clocks
+    {7, 4, "7/4"}     // 4 steps every 7 clocks
+};
+static const int NUM_DIVISIONS = 16;
+
+// External clock smoothing of a new or initialized engine, see
+// SequencerEngine::clockSmoothing
+static const float DEFAULT_CLOCK_SMOOTHING = 0.5f;
+
+// Direction modes
+enum Direction {
+    DIR_FORWARD,
+    DIR_REVERSE,
+    DIR_PENDULUM,
+    DIR_RANDOM
+};
+
+// Pitches are stored as codes of the hardware's 12-bit pitch DAC
+// (REQUIREMENTS.md), 0-4095 over 0-5 V. The firmware writes them to its
+// DAC as they are; the engine turns them into volts through a table per
+// output, and only when a step changes.
+static const int PITCH_CODE_MAX = 4095;
+static const float PITCH_CODE_VOLTS = 5.f;
+
+// Nearest code to a voltage, clamped to the DAC range
+int pitchToCode(float volts);
+// Nominal voltage of a code
+float codeToPitch(int code);
+
+// Scale quantizer. A scale is a set of the 12 semitones of an octave, bit
+// n for the note n semitones above the root, at 1 V/octave with C at 0 V.
+// Pitches snap to the nearest note of the scale (the lower one on a tie).
+// Any set of notes can be used; these are the presets.
+struct ScalePreset {
+    uint16_t notes;
+    const char* name;
+};
+
+static const uint16_t SCALE_ALL_NOTES = 0xFFF;
+
+static const ScalePreset SCALES[] = {
+    {0xFFF, "Chromatic"},
+    {0xAB5, "Major"},             // 0 2 4 5 7 9 11
+    {0x5AD, "Natural minor"},     // 0 2 3 5 7 8 10
+    {0x9AD, "Harmonic minor"},    // 0 2 3 5 7 8 11
+    {0x6AD, "Dorian"},            // 0 2 3 5 7 9 10
+    {0x5AB, "Phrygian"},          // 0 1 3 5 7 8 10
+    {0xAD5, "Lydian"},            // 0 2 4 6 7 9 11
+    {0x6B5, "Mixolydian"},        // 0 2 4 5 7 9 10
+    {0x295, "Major pentatonic"},  // 0 2 4 7 9
+    {0x4A9, "Minor pentatonic"},  // 0 3 5 7 10
+    {0x4E9, "Blues"},             // 0 3 5 6 7 10
+    {0x555, "Whole tone"}         // 0 2 4 6 8 10
+};
+static const int NUM_SCALES = 12;
+
+// Quantizer setting of one track output
+struct Quantizer {
+    uint16_t scale = 0;  // Notes, see SCALES. No notes is off.
+    int root = 0;        // Semitones above C, 0-11
+};
+
+// Track data structure
+template <int STEPS>
+struct TrackDataT {
+    typedef typename StepMaskT<STEPS>::Type StepMask;
+
+    int stepCount = STEPS;
+    int divisionIndex = 2;  // Default 1/4
+    Direction direction = DIR_FORWARD;
+    // Key for the random direction's picks
+    uint32_t seed = 0;
+    // Pitch codes, see PITCH_CODE_MAX
+    uint16_t pitches[STEPS] = {0};
+    // Gate on/off, see StepMask.hpp. All on by default.
+    StepMask gates = (StepMask)firstSteps(STEPS);
+
+    bool gate(int s) const {
+        return (gates >> s) & 1;
+    }
+};
+
+// Scene stores complete state of all tracks
+template <int TRACKS, int STEPS>
+struct SceneDataT {
+    TrackDataT<STEPS> tracks[TRACKS];
+    bool isEmpty = true;
+};
+
+template <int TRACKS, int STEPS>
+struct SceneHistoryT;
+
+// Edits another thread sends to the audio thread, see postCommand()
+enum CommandType {
+    CMD_SET_PITCH,           // track, step, pitch (code)
+    CMD_TOGGLE_GATE,         // track, step
+    CMD_SET_TRACK_SETTINGS,  // track, stepCount, divisionIndex, direction
+    CMD_SET_SEED,            // track, seed
+    CMD_SET_LOCK_SEED,       // on
+    CMD_PRESS_SCENE,         // scene
+    CMD_ROTATE_GATES,        // track, amount (steps towards later steps)
+    CMD_INVERT_GATES,        // track
+    CMD_EUCLID_GATES,        // track, amount (pulses)
+    CMD_SET_QUANTIZER,       // track, scale, root
+    CMD_SET_CLOCK_SMOOTHING, // smoothing
+    CMD_UNDO,
+    CMD_REDO
+};
+
+struct Command {
+    CommandType type = CMD_UNDO;
+    int track = 0;
+    int step = 0;
+    int scene = 0;
+    int stepCount = 1;
+    int divisionIndex = 0;
+    Direction direction = DIR_FORWARD;
+    int pitch = 0;
+    uint32_t seed = 0;
+    int amount = 0;
+    int scale = 0;
+    int root = 0;
+    bool on = false;
+    float smoothing = 0.f;
+};
+
+// Edge detector with hysteresis, same thresholds as Rack's dsp::SchmittTrigger
+struct EdgeTrigger {
+    bool state = true;
+
+    bool process(float in) {
+        if (state) {
+            if (in <= 0.f)
+                state = false;
+        } else if (in >= 1.f) {
+            state = true;
+            return true;
+        }
+        return false;
+    }
+};
+
+// Pulse defined by the sample index where it ends, so it costs nothing
+// while running and never accumulates rounding error
+struct PulseTimer {
+    int64_t endSample = 0;
+
+    void trigger(int64_t now, int64_t durationSamples) {
+        if (now + durationSamples > endSample)
+            endSample = now + durationSamples;
+    }
+
+    bool isHigh(int64_t now) const {
+        return now < endSample;
+    }
+};
+
+// Plain new only honours alignas() beyond alignof(max_align_t) from C++17
+// on. Types with cache-line aligned members, and anything embedding them,
+// derive from this to get aligned heap allocation.
+struct CacheAligned {
+    static const size_t CACHE_LINE = 64;
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
+};
+
+template <int TRACKS, int STEPS, int SCENES>
+struct SequencerEngine : CacheAligned {
+    static const int NUM_TRACKS = TRACKS;
+    static const int NUM_STEPS = STEPS;
+    static const int NUM_SCENES = SCENES;
+
+    typedef TrackDataT<STEPS> TrackData;
+    typedef SceneDataT<TRACKS, STEPS> SceneData;
+    typedef SceneHistoryT<TRACKS, STEPS> History;
+
+    // Per-sample control inputs
+    struct Inputs {
+        float sampleRate = 44100.f;
+        float bpm = 120.f;
+        float swing = 0.f;       // 0-1
+        float pulseWidth = 0.5f; // 0-1
+        bool clockConnected = false;
+        float clock = 0.f;
+        float reset = 0.f;
+        bool sceneCvConnected = false;
+        float sceneCv = 0.f;
+    };
+
+    // Per-sample results
+    struct Outputs {
+        float pitch[NUM_TRACKS] = {0.f};
+        bool gate[NUM_TRACKS] = {false};
+        bool clock = false;
+        bool reset = false;
+        float sceneCv = 0.f;
+        // Set when the current scene was switched or reloaded this sample
+        bool sceneChanged = false;
+    };
+
+    // Optional per-sample port buffers for processBlock(). A null buffer
+    // holds the corresponding Inputs field for the whole block.
+    struct BlockInputs {
+        const float* clock = nullptr;
+        const float* reset = nullptr;
+        const float* sceneCv = nullptr;
+    };
+
+    // Output buffers for processBlock(), in volts. Null buffers are skipped.
+    struct BlockOutputs {
+        float* pitch[NUM_TRACKS] = {nullptr};
+        float* gate[NUM_TRACKS] = {nullptr};
+        float* clock = nullptr;
+        float* reset = nullptr;
+        float* sceneCv = nullptr;
+    };
+
+    // Everything a patch sets, decoded and validated as a whole (see
+    // SequencerJson.hpp) so a load replaces the engine state in one step
+    struct PatchState {
+        SceneData scenes[NUM_SCENES];
+        int currentScene = 0;
+        bool isRunning = true;
+        bool lockSeed = false;
+        Quantizer quantizers[NUM_TRACKS];
+    };
+
+    // Per-track lanes: tracks rounded up to whole 4-wide SIMD vectors
+    static const int LANES = (TRACKS + 3) / 4 * 4;
+
+    // Hot playback state, read or written by process() on every sample.
+    // One lane per track, padded with idle lanes (a ratio of 0 steps never
+    // fires) so the track loop runs over whole vectors without branches.
+    // Values copied from the current scene are refreshed by syncLanes().
+    struct alignas(CACHE_LINE) PlaybackLanes {
+        // Clock ratio state. A ratio cycle spans `clocks` beats and holds
+        // `steps` steps; step j starts at tick j * clocks, counting ticks of
+        // 1/steps beat from the cycle start. The step at the cycle start is
+        // the one shown after a reset, so counting resumes at step 1.
+        int32_t cycleBeat[LANES];
+        int32_t cycleStep[LANES];
+        // Current scene's clock ratio
+        int32_t ratioClocks[LANES];
+        int32_t ratioSteps[LANES];
+        // Sample where the gate ends, and where a swung gate starts
+        // (INT64_MAX when none is pending)
+        int64_t gateEnd[LANES];
+        int64_t swingGateAt[LANES];
+        float pitch[LANES];
+        // Gate of the current step, output while stopped
+        int32_t heldGate[LANES];
+    };
+    PlaybackLanes lanes;
+
+    // Step state, touched only when a track steps
+    int currentStep[NUM_TRACKS] = {0};
+    int stepParity[NUM_TRACKS] = {0};
+    int pendingSwingStep[NUM_TRACKS] = {0};
+    int64_t swingGateLength[NUM_TRACKS] = {0};
+    int outputStep[NUM_TRACKS] = {0};
+
+    // Step order tables, rebuilt when a track's step count or direction
+    // changes. Entry 0 is the step a reset returns to; each step moves one
+    // entry on (or to a random entry) and plays the step found there.
+    static const int MAX_ORDER = 2 * STEPS;
+    static_assert(STEPS <= 256, "step orders are stored as bytes");
+    uint8_t stepOrder[NUM_TRACKS][MAX_ORDER];
+    int orderLength[NUM_TRACKS];
+    int orderIndex[NUM_TRACKS] = {0};
+    // Steps played since the last reset. Random picks are a function of
+    // this count, so any position can be computed without replaying.
+    uint64_t stepCounter[NUM_TRACKS] = {0};
+    // Settings the tables were built for
+    int orderSteps[NUM_TRACKS];
+    Direction orderDirection[NUM_TRACKS];
+
+    // Edit-time state. Scene data is written through the edit methods
+    // below; after writing it (or currentScene) directly, call syncLanes()
+    // and touchScene().
+    SceneData scenes[NUM_SCENES];
+    int currentScene = 0;
+    int copySourceScene = -1;
+    bool deleteMode = false;
+    // Edit count per scene, so savers can re-encode only scenes that
+    // changed since their last save
+    uint32_t sceneRevision[NUM_SCENES] = {0};
+    // Undo history, owned by the caller (see SceneHistory.hpp). Every edit
+    // method records into it; null disables undo.
+    History* history = nullptr;
+
+    // Triggers
+    EdgeTrigger clockTrigger;
+    EdgeTrigger resetTrigger;
+
+    // Clock and reset output pulses
+    PulseTimer clockOutputPulse;
+    PulseTimer resetOutputPulse;
+
+    // Pulse counters so slower consumers (LEDs) can catch pulses that
+    // start and end between two of their updates
+    uint32_t gateCount[NUM_TRACKS] = {0};
+    uint32_t resetCount = 0;
+
+    // Timebase: index of the sample being processed. All timing is kept as
+    // exact sample counts relative to this, so it never loses precision.
+    int64_t sampleCount = 0;
+    float sampleRate = 44100.f;
+
+    // Internal clock: 64-bit phase accumulator, one beat per wrap
+    uint64_t internalClockPhase = 0;
+    uint64_t internalClockIncrement = 0;
+    int64_t internalClockPeriod = 0;
+    float internalClockBpm = 0.f;
+    float internalClockRate = 0.f;
+    // 1 ms trigger length at the current rate
+    int64_t pulseSamples = 44;
+    bool isRunning = true;
+    int64_t stoppedAtSample = 0;
+
+    // Clock period tracking
+    int64_t lastClockSample = 0;
+    int64_t clockPeriodSamples = 22050;
+
+    // External clock PLL: a phase accumulator like the internal clock whose
+    // tempo follows the smoothed edge interval and whose phase is pulled
+    // towards each edge over the following beat. Multiplied tracks subdivide
+    // its beat, so sub-steps stay evenly spaced when the clock jitters. It
+    // never starts a beat before its clock edge: at the end of a beat it
+    // holds until the edge arrives, so a stopped clock stops the sequencer
+    // on the last edge. It runs only once two edges have measured a period.
+    uint64_t pllPhase = 0;
+    uint64_t pllIncrement = 0;
+    double pllPeriod = 0.0;
+    // Beats started by the PLL and clock edges seen since it last locked
+    int64_t pllBeat = 0;
+    int64_t edgeBeat = 0;
+    bool pllLocked = false;
+    // External clock smoothing, 0 to below 1. 0 hard-syncs to every edge
+    // like a plain clock input; higher values follow jitter and tempo
+    // changes more slowly (at 1 the PLL would never correct). Set it with
+    // CMD_SET_CLOCK_SMOOTHING while the audio thread runs.
+    float clockSmoothing = DEFAULT_CLOCK_SMOOTHING;
+
+    // Random direction picks are keyed by each track's seed and, unless
+    // the seeds are locked, by a session seed that changes on every reset.
+    // Locked seeds replay the same random pattern from every reset.
+    bool lockSeed = false;
+    uint64_t randomSeed = 0x9E3779B97F4A7C15ull;
+
+    // State handoff from postState() to the audio thread
+    std::atomic<PatchState*> pendingState{nullptr};
+    std::atomic<PatchState*> loadedState{nullptr};
+    // Last state posted, owned by the posting thread
+    PatchState* postedState = nullptr;
+
+    // Commands from postCommand(), drained by the audio thread. Last, so
+    // the ring does not sit between fields process() uses.
+    static const int COMMAND_CAPACITY = 64;
+    SpscQueue<Command, COMMAND_CAPACITY> commands;
+
+    // Per track output settings the pitch tables are built from
+    Quantizer quantizers[NUM_TRACKS];
+    float outputVolts0[NUM_TRACKS];
+    float outputGain[NUM_TRACKS];  // Volts out per nominal volt
+
+    // Output voltage of every pitch code, per track output: the code's
+    // pitch quantized to the track's scale, then calibrated. Looked up when
+    // a step changes, and rebuilt only when those settings change.
+    float pitchTable[NUM_TRACKS][PITCH_CODE_MAX + 1];
+
+    SequencerEngine();
+    SequencerEngine(const SequencerEngine&) = delete;
+    SequencerEngine& operator=(const SequencerEngine&) = delete;
+
+    // Clears all scenes, playback state and patch settings, like a new
+    // engine. Random picks start over from a new session seed.
+    void clear();
+
+    TrackData& track(int t) {
+        return scenes[currentScene].tracks[t];
+    }
+
+    bool gateHigh(int t) const {
+        return sampleCount < lanes.gateEnd[t];
+    }
+
+    // Tempo of the clock currently driving the sequencer
+    float clockBpm() const {
+        return clockPeriodSamples > 0 ? 60.f * sampleRate / clockPeriodSamples : 0.f;
+    }
+
+    // Front panel actions
+    void resetPlayback();
+    void toggleRun();
+    void pressCopy();
+    void pressDelete();
+    // Returns true if the current scene was switched or reloaded
+    bool pressScene(int s);
+
+    // Jumps to a song position: `beat` whole beats plus `beatFraction`
+    // after the last reset, as if every track had played the current
+    // scene since then. Takes the same time for any position. Outputs
+    // change to the step found there; its gate is not fired.
+    void seek(int64_t beat, double beatFraction = 0.0);
+
+    // Replaces the scenes and patch settings. Playback carries on from the
+    // current position in the loaded scene.
+    void loadState(const PatchState& state);
+
+    // Loads a state on the audio thread: the next process() or
+    // processBlock() call picks it up before its first sample, so a load
+    // never lands halfway through a block. The caller keeps ownership.
+    // Returns the previously posted state, loaded or dropped, once the
+    // audio thread no longer uses it; post nullptr to get the last one
+    // back. Only one thread may post.
+    PatchState* postState(PatchState* state);
+
+    // Queues an edit for the audio thread, which applies all queued
+    // commands in order at the start of its next process() or
+    // processBlock() call, like a posted state. Only one thread may post.
+    // Returns false if the queue is full.
+    bool postCommand(const Command& command) {
+        return commands.push(command);
+    }
+    // Applies a command now. Returns true if the current scene was edited,
+    // switched or reloaded.
+    bool applyCommand(const Command& command);
+
+    // Track edits, on the current scene. Writing a value a field already
+    // holds does not count as an edit.
+    void setTrackSettings(int t, int stepCount, int divisionIndex, Direction direction);
+    void toggleGate(int t, int s);
+    void setPitch(int t, int s, int code);
+    void setSeed(int t, uint32_t seed);
+    // Gate patterns over the track's active steps; steps past its step
+    // count keep their gates
+    void rotateGates(int t, int amount);
+    void invertGates(int t);
+    void fillEuclid(int t, int pulses);
+    // Maps pitch codes linearly onto volts0..voltsMax for track output t,
+    // e.g. to match a measured DAC channel
+    void calibrateOutput(int t, float volts0, float voltsMax);
+    // Quantizes track output t to a scale (see SCALES) transposed to
+    // `root`; a scale with no notes turns quantizing off
+    void setQuantizer(int t, int scale, int root);
+
+    // Steps back or forward through the undo history. Return true if the
+    // current scene was changed or switched.
+    bool undo();
+    bool redo();
+    // Marks a scene as edited
+    void touchScene(int s) {
+        sceneRevision[s]++;
+    }
+    // Refreshes the playback lanes from the current scene
+    void syncLanes();
+
+    void process(const Inputs& in, Outputs& out);
+
+    // Event-scheduled block processing. Finds the next sample where anything
+    // can happen (clock wrap, sub-step, swung gate, pulse end, port edge)
+    // and fills the outputs in constant runs up to it, running the full
+    // per-sample path only on event samples. Returns true if the scene changed.
+    bool processBlock(const Inputs& in, const BlockInputs& blockIn, const BlockOutputs& blockOut, int frames);
+
+private:
+    // Loads a posted state and applies queued commands, returns true if
+    // the current scene changed. Checked on every call, so the nothing
+    // pending case is inline.
+    bool applyPending() {
+        if (!pendingState.load(std::memory_order_relaxed) && commands.empty())
+            return false;
+        return applyPendingSlow();
+    }
+    bool applyPendingSlow();
+    // Records scene `s` in the history before an edit
+    void recordEdit(int s, uint32_t key);
+    void setGates(int t, uint64_t gates);
+    float pitchVolts(int t, int code) const {
+        return pitchTable[t][code & PITCH_CODE_MAX];
+    }
+    void buildPitchTable(int t);
+    bool restoredScene(int s);
+    void processSample(const Inputs& in, Outputs& out);
+    bool switchScene(int s);
+    void syncTrack(int t);
+    void buildStepOrder(int t, int steps, Direction direction);
+    void updateInternalClock(const Inputs& in);
+    // Handles an external clock edge, returns true if a new beat starts
+    bool syncPll(int64_t now, float smoothing);
+    // Advances the PLL by one sample, returns true if a new beat starts
+    bool advancePll();
+    int64_t msToSamples(float ms) const;
+    // Gate length for a step, kept clear of the next step when delayed
+    int64_t gateSamples(int64_t stepSamples, int64_t delaySamples, float pulseWidth) const;
+    // Number of upcoming samples in which process() would only advance
+    // timers, ignoring port input edges
+    int quietSamples(const Inputs& in);
+    // Advances all timers by n quiet samples in one go
+    void skipSamples(const Inputs& in, int n);
+    void advanceStep(int track);
+    void stepTrack(int t, int64_t now, const Inputs& in);
+    void fireSwungGate(int t, int64_t now);
+    // Order index for a track's n-th step in random direction
+    int randomIndex(int t, uint64_t n) const;
+};
+
+template <int TRACKS, int STEPS, int SCENES>
+const int SequencerEngine<TRACKS, STEPS, SCENES>::NUM_TRACKS;
+template <int TRACKS, int STEPS, int SCENES>
+const int SequencerEngine<TRACKS, STEPS, SCENES>::NUM_STEPS;
+template <int TRACKS, int STEPS, int SCENES>
+const int SequencerEngine<TRACKS, STEPS, SCENES>::NUM_SCENES;
+
+// Engine sizes (tracks x steps x scenes)
+typedef SequencerEngine<3, 8, 8> SequencerCore;  // SENGBARD Sequencer
+typedef SequencerEngine<4, 16, 16> SequencerCore4x16;
+typedef SequencerEngine<8, 64, 32> SequencerCore8x64;
@@ -0,0 +1,181 @@
+#include "SequencerJson.hpp"
+#include "SequencerBlob.hpp"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+// Integer field clamped to [lo, hi], or `fallback` if missing or not a number
+static int intField(const json_t* objJ, const char* key, int lo, int hi, int fallback) {
+    json_t* valueJ = json_object_get(objJ, key);
+    if (json_is_integer(valueJ))
+        return (int)std::max<json_int_t>(std::min<json_int_t>(json_integer_value(valueJ), hi), lo);
+    if (json_is_real(valueJ) && std::isfinite(json_real_value(valueJ)))
+        return (int)std::max(std::min(std::round(json_real_value(valueJ)), (double)hi), (double)lo);
+    return fallback;
+}
+
+static bool boolField(const json_t* objJ, const char* key, bool fallback) {
+    json_t* valueJ = json_object_get(objJ, key);
+    return json_is_boolean(valueJ) ? json_is_true(valueJ) : fallback;
+}
+
+// Pitch code of a voltage, 0 for anything that is not a finite number
+static uint16_t pitchValue(const json_t* valueJ) {
+    double volts = json_number_value(valueJ);
+    if (!std::isfinite(volts))
+        return 0;
+    return (uint16_t)pitchToCode((float)std::max(std::min(volts, (double)PITCH_CODE_VOLTS), 0.0));
+}
+
+// Shared by engineToJson and patchStateToJson. The cache is only used
+// with scene revisions.
+template <class Engine>
+static void patchToJson(json_t* rootJ, int currentScene, bool isRunning, bool lockSeed, const Quantizer* quantizers,
+    const typename Engine::SceneData* scenes, const uint32_t* sceneRevision, SceneJsonCache<Engine>* cache) {
+    if (!sceneRevision)
+        cache = nullptr;
+    json_object_set_new(rootJ, "version", json_integer(PATCH_VERSION));
+    json_object_set_new(rootJ, "currentScene", json_integer(currentScene));
+    json_object_set_new(rootJ, "isRunning", json_boolean(isRunning));
+    json_object_set_new(rootJ, "lockSeed", json_boolean(lockSeed));
+
+    // Quantizer per track output, scale as a note mask (see SCALES)
+    json_t* quantizersJ = json_array();
+    for (int t = 0; t < Engine::NUM_TRACKS; t++) {
+        json_t* quantizerJ = json_object();
+        json_object_set_new(quantizerJ, "scale", json_integer(quantizers[t].scale));
+        json_object_set_new(quantizerJ, "root", json_integer(quantizers[t].root));
+        json_array_append_new(quantizersJ, quantizerJ);
+    }
+    json_object_set_new(rootJ, "quantizers", quantizersJ);
+
+    // Scenes as packed blobs, see SequencerBlob.hpp
+    SceneBlobT<Engine::NUM_TRACKS, Engine::NUM_STEPS> blob;
+    json_t* blobsJ = json_array();
+    for (int i = 0; i < Engine::NUM_SCENES; i++) {
+        uint32_t revision = cache ? sceneRevision[i] : 0;
+        if (cache && !cache->text[i].empty() && cache->revision[i] == revision) {
+            json_array_append_new(blobsJ, json_string(cache->text[i].c_str()));
+            continue;
+        }
+        blob.encode(scenes[i]);
+        std::string text = toBase64(blob.bytes, sizeof(blob.bytes));
+        json_array_append_new(blobsJ, json_string(text.c_str()));
+        if (cache) {
+            cache->text[i].swap(text);
+            cache->revision[i] = revision;
+        }
+    }
+    json_object_set_new(rootJ, "sceneBlobs", blobsJ);
+}
+
+template <class Engine>
+void engineToJson(const Engine& core, json_t* rootJ, SceneJsonCache<Engine>* cache) {
+    patchToJson<Engine>(rootJ, core.currentScene, core.isRunning, core.lockSeed, core.quantizers, core.scenes,
+        core.sceneRevision, cache);
+}
+
+template <class Engine>
+void patchStateToJson(const typename Engine::PatchState& state, json_t* rootJ, SceneJsonCache<Engine>* cache,
+    const uint32_t* sceneRevision) {
+    patchToJson<Engine>(rootJ, state.currentScene, state.isRunning, state.lockSeed, state.quantizers, state.scenes,
+        sceneRevision, cache);
+}
+
+// Version 1 scene, stored as JSON
+template <class Engine>
+static void sceneFromJson(typename Engine::SceneData& scene, const json_t* sceneJ) {
+    scene.isEmpty = boolField(sceneJ, "isEmpty", scene.isEmpty);
+
+    json_t* tracksJ = json_object_get(sceneJ, "tracks");
+    int numTracks = std::min(Engine::NUM_TRACKS, (int)json_array_size(tracksJ));
+    for (int t = 0; t < numTracks; t++) {
+        typename Engine::TrackData& trackData = scene.tracks[t];
+        json_t* trackJ = json_array_get(tracksJ, t);
+        trackData.stepCount = intField(trackJ, "stepCount", 1, Engine::NUM_STEPS, trackData.stepCount);
+        trackData.divisionIndex = intField(trackJ, "divisionIndex", 0, NUM_DIVISIONS - 1, trackData.divisionIndex);
+        trackData.direction = (Direction)intField(trackJ, "direction", DIR_FORWARD, DIR_RANDOM, trackData.direction);
+        json_t* seedJ = json_object_get(trackJ, "seed");
+        if (json_is_integer(seedJ)) trackData.seed = (uint32_t)json_integer_value(seedJ);
+
+        json_t* pitchesJ = json_object_get(trackJ, "pitches");
+        json_t* gatesJ = json_object_get(trackJ, "gates");
+        int numPitches = std::min(Engine::NUM_STEPS, (int)json_array_size(pitchesJ));
+        int numGates = std::min(Engine::NUM_STEPS, (int)json_array_size(gatesJ));
+        for (int s = 0; s < numPitches; s++) {
+            trackData.pitches[s] = pitchValue(json_array_get(pitchesJ, s));
+        }
+        // Gates were an array of booleans
+        uint64_t gates = trackData.gates;
+        for (int s = 0; s < numGates; s++) {
+            json_t* gateJ = json_array_get(gatesJ, s);
+            if (json_is_boolean(gateJ))
+                gates = json_is_true(gateJ) ? gates | stepBit(s) : gates & ~stepBit(s);
+        }
+        trackData.gates = (typename Engine::TrackData::StepMask)gates;
+    }
+}
+
+template <class Engine>
+bool patchStateFromJson(typename Engine::PatchState& state, const json_t* rootJ) {
+    if (!json_is_object(rootJ))
+        return false;
+
+    state.currentScene = intField(rootJ, "currentScene", 0, Engine::NUM_SCENES - 1, 0);
+    state.isRunning = boolField(rootJ, "isRunning", true);
+    state.lockSeed = boolField(rootJ, "lockSeed", false);
+
+    json_t* quantizersJ = json_object_get(rootJ, "quantizers");
+    for (int t = 0; t < Engine::NUM_TRACKS; t++) {
+        json_t* quantizerJ = json_array_get(quantizersJ, t);
+        state.quantizers[t].scale = (uint16_t)intField(quantizerJ, "scale", 0, SCALE_ALL_NOTES, 0);
+        state.quantizers[t].root = intField(quantizerJ, "root", 0, 11, 0);
+    }
+
+    // Version 2 stores scenes as blobs in "sceneBlobs", checked and
+    // clamped by the decoder. Version 1 stored them as JSON in "scenes",
+    // which is migrated field by field. "scenes" is no longer written.
+    int version = intField(rootJ, "version", 1, PATCH_VERSION, 1);
+    json_t* blobsJ = version >= 2 ? json_object_get(rootJ, "sceneBlobs") : nullptr;
+    json_t* scenesJ = version < 2 ? json_object_get(rootJ, "scenes") : nullptr;
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < Engine::NUM_SCENES; i++) {
+        state.scenes[i] = typename Engine::SceneData();
+        const char* text = json_string_value(json_array_get(blobsJ, i));
+        if (text && fromBase64(text, bytes)
+            && SceneBlobT<Engine::NUM_TRACKS, Engine::NUM_STEPS>::decode(bytes.data(), bytes.size(), state.scenes[i]))
+            continue;
+        json_t* sceneJ = json_array_get(scenesJ, i);
+        if (json_is_object(sceneJ))
+            sceneFromJson<Engine>(state.scenes[i], sceneJ);
+    }
+
+    // Scene 0 cannot be deleted, and playback needs a scene in use
+    state.scenes[0].isEmpty = false;
+    state.scenes[state.currentScene].isEmpty = false;
+    return true;
+}
+
+template <class Engine>
+void engineFromJson(Engine& core, const json_t* rootJ) {
+    std::unique_ptr<typename Engine::PatchState> state(new typename Engine::PatchState);
+    if (patchStateFromJson<Engine>(*state, rootJ))
+        core.loadState(*state);
+}
+
+// Engine sizes in use, see SequencerCore.hpp
+template void engineToJson(const SequencerCore& core, json_t* rootJ, SceneJsonCache<SequencerCore>* cache);
+template void patchStateToJson<SequencerCore>(const SequencerCore::PatchState& state, json_t* rootJ, SceneJsonCache<SequencerCore>* cache,
+    const uint32_t* sceneRevision);
+template bool patchStateFromJson<SequencerCore>(SequencerCore::PatchState& state, const json_t* rootJ);
+template void engineFromJson(SequencerCore& core, const json_t* rootJ);
+template void engineToJson(const SequencerCore4x16& core, json_t* rootJ, SceneJsonCache<SequencerCore4x16>* cache);
+template void patchStateToJson<SequencerCore4x16>(const SequencerCore4x16::PatchState& state, json_t* rootJ, SceneJsonCache<SequencerCore4x16>* cache,
+    const uint32_t* sceneRevision);
+template bool patchStateFromJson<SequencerCore4x16>(SequencerCore4x16::PatchState& state, const json_t* rootJ);
+template void engineFromJson(SequencerCore4x16& core, const json_t* rootJ);
+template void engineToJson(const SequencerCore8x64& core, json_t* rootJ, SceneJsonCache<SequencerCore8x64>* cache);
+template void patchStateToJson<SequencerCore8x64>(const SequencerCore8x64::PatchState& state, json_t* rootJ, SceneJsonCache<SequencerCore8x64>* cache,
+    const uint32_t* sceneRevision);
+template bool patchStateFromJson<SequencerCore8x64>(SequencerCore8x64::PatchState& state, const json_t* rootJ);
+template void engineFromJson(SequencerCore8x64& core, const json_t* rootJ);
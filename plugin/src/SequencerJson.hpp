@@ -0,0 +1,43 @@
+#pragma once
+// Patch state as JSON, shared by the Rack module and the headless tools.
+// Covers the engine's scenes and playback settings. Module-only state
+// (selected track, menu settings) is added by the module itself.
+#include "SequencerCore.hpp"
+#include <jansson.h>
+#include <string>
+
+// Schema version written to patches. Patches without one are version 1,
+// which stored scenes as JSON; version 2 stores them as blobs.
+static const int PATCH_VERSION = 2;
+
+// Scene encodings from earlier saves, each tagged with the scene revision
+// it was made from
+template <class Engine>
+struct SceneJsonCache {
+    std::string text[Engine::NUM_SCENES];
+    uint32_t revision[Engine::NUM_SCENES];
+};
+
+// Writes the engine state into a patch object. With a cache, only scenes
+// edited since the previous save are encoded again.
+template <class Engine>
+void engineToJson(const Engine& core, json_t* rootJ, SceneJsonCache<Engine>* cache = nullptr);
+
+// Writes a patch state, such as a snapshot the audio thread published,
+// into a patch object. `sceneRevision` holds the engine's revision of each
+// snapshot scene; with it, a cache works as for engineToJson.
+template <class Engine>
+void patchStateToJson(const typename Engine::PatchState& state, json_t* rootJ, SceneJsonCache<Engine>* cache = nullptr,
+    const uint32_t* sceneRevision = nullptr);
+
+// Decodes a patch into `state` in one pass, migrating older versions.
+// Missing fields and fields of the wrong type take their defaults, and
+// out-of-range values are clamped, so any result is safe to load. Returns
+// false, leaving `state` untouched, if rootJ is not a patch object.
+// Touches no engine state, so it can run on any thread.
+template <class Engine>
+bool patchStateFromJson(typename Engine::PatchState& state, const json_t* rootJ);
+
+// Decodes a patch and loads it on the calling thread
+template <class Engine>
+void engineFromJson(Engine& core, const json_t* rootJ);
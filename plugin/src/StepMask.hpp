@@ -0,0 +1,52 @@
+#pragma once
+// Per-step flags of a track stored as a bitmask, bit s for step s, in the
+// smallest integer that holds every step. Pattern edits work on whole
+// masks: within the first n steps, "any gate on" is `mask & firstSteps(n)`,
+// invert is `mask ^ firstSteps(n)`, rotate is a pair of shifts and a
+// euclidean fill builds its mask in one pass over the steps. One byte per
+// 8 steps is also the layout of the hardware's 74HC595 LED shift registers.
+#include <cstdint>
+#include <type_traits>
+
+template <int STEPS>
+struct StepMaskT {
+    static_assert(STEPS >= 1 && STEPS <= 64, "step masks hold up to 64 steps");
+    typedef typename std::conditional<(STEPS <= 8), uint8_t,
+        typename std::conditional<(STEPS <= 16), uint16_t,
+        typename std::conditional<(STEPS <= 32), uint32_t, uint64_t>::type>::type>::type Type;
+};
+
+// Masks are handled as uint64_t and narrowed when stored
+
+inline uint64_t stepBit(int s) {
+    return (uint64_t)1 << s;
+}
+
+// Mask of steps 0 to n-1
+inline uint64_t firstSteps(int n) {
+    return n >= 64 ? ~(uint64_t)0 : stepBit(n) - 1;
+}
+
+// Rotates steps 0 to n-1 by `amount` steps towards later steps (negative
+// rotates towards earlier ones). Steps from n on are kept as they are.
+inline uint64_t rotateSteps(uint64_t mask, int n, int amount) {
+    uint64_t active = firstSteps(n);
+    uint64_t bits = mask & active;
+    int shift = ((amount % n) + n) % n;
+    if (shift != 0)
+        bits = ((bits << shift) | (bits >> (n - shift))) & active;
+    return (mask & ~active) | bits;
+}
+
+// `pulses` steps spread as evenly as possible over steps 0 to n-1, the
+// first on step 0 (Bresenham's line, which gives the euclidean rhythms)
+inline uint64_t euclidSteps(int pulses, int n) {
+    if (pulses >= n)
+        return firstSteps(n);
+    uint64_t mask = 0;
+    for (int s = 0; s < n && pulses > 0; s++) {
+        if ((s * pulses) % n < pulses)
+            mask |= stepBit(s);
+    }
+    return mask;
+}
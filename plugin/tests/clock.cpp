@@ -0,0 +1,191 @@
+#include "test.hpp"
+#include "SequencerCore.hpp"
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+static const float RATE = 48000.f;
+static const int BEAT = 24000;  // 120 BPM at 48 kHz
+
+// Division indices, see DIVISIONS
+static const int DIV_1_1 = 0;
+static const int DIV_1_2 = 1;
+static const int DIV_1_4 = 2;
+static const int DIV_1_8 = 3;
+static const int DIV_1_32 = 7;
+
+// Samples where each track's gate went high
+struct GateLog {
+    std::vector<int64_t> rises[SequencerCore::NUM_TRACKS];
+};
+
+static std::unique_ptr<SequencerCore> makeEngine(const int (&divisions)[SequencerCore::NUM_TRACKS]) {
+    std::unique_ptr<SequencerCore> core(new SequencerCore);
+    for (int t = 0; t < SequencerCore::NUM_TRACKS; t++) {
+        core->setTrackSettings(t, SequencerCore::NUM_STEPS, divisions[t], DIR_FORWARD);
+    }
+    return core;
+}
+
+// 1 ms pulses into CLK IN starting at each of `edges`
+static std::vector<float> clockPulses(const std::vector<int64_t>& edges, int64_t length) {
+    std::vector<float> clock(length, 0.f);
+    for (int64_t edge : edges) {
+        for (int64_t i = edge; i < std::min(edge + 48, length); i++)
+            clock[i] = 10.f;
+    }
+    return clock;
+}
+
+static GateLog runPerSample(SequencerCore& core, const std::vector<float>& clock, float smoothing) {
+    SequencerCore::Inputs in;
+    in.sampleRate = RATE;
+    in.clockConnected = true;
+    core.clockSmoothing = smoothing;
+    SequencerCore::Outputs out;
+    GateLog log;
+    bool gate[SequencerCore::NUM_TRACKS] = {};
+    for (size_t i = 0; i < clock.size(); i++) {
+        in.clock = clock[i];
+        core.process(in, out);
+        for (int t = 0; t < SequencerCore::NUM_TRACKS; t++) {
+            if (out.gate[t] && !gate[t])
+                log.rises[t].push_back((int64_t)i);
+            gate[t] = out.gate[t];
+        }
+    }
+    return log;
+}
+
+static GateLog runBlocks(SequencerCore& core, const std::vector<float>& clock, float smoothing) {
+    static const int FRAMES = 512;
+    SequencerCore::Inputs in;
+    in.sampleRate = RATE;
+    in.clockConnected = true;
+    core.clockSmoothing = smoothing;
+    float gates[SequencerCore::NUM_TRACKS][FRAMES];
+    SequencerCore::BlockOutputs blockOut;
+    for (int t = 0; t < SequencerCore::NUM_TRACKS; t++) {
+        blockOut.gate[t] = gates[t];
+    }
+    GateLog log;
+    bool gate[SequencerCore::NUM_TRACKS] = {};
+    for (size_t i = 0; i < clock.size(); i += FRAMES) {
+        int frames = (int)std::min(clock.size() - i, (size_t)FRAMES);
+        SequencerCore::BlockInputs blockIn;
+        blockIn.clock = &clock[i];
+        core.processBlock(in, blockIn, blockOut, frames);
+        for (int k = 0; k < frames; k++) {
+            for (int t = 0; t < SequencerCore::NUM_TRACKS; t++) {
+                bool on = gates[t][k] > 0.f;
+                if (on && !gate[t])
+                    log.rises[t].push_back((int64_t)(i + k));
+                gate[t] = on;
+            }
+        }
+    }
+    return log;
+}
+
+// A stopped clock stops every track within the beat of its last edge
+TEST(pll_holds_after_last_edge) {
+    const int divisions[] = {DIV_1_4, DIV_1_32, DIV_1_8};
+    std::vector<int64_t> edges;
+    for (int k = 0; k < 12; k++) {
+        edges.push_back(1000 + k * BEAT);
+    }
+    int64_t lastEdge = edges.back();
+    std::vector<float> clock = clockPulses(edges, lastEdge + 4 * BEAT);
+    for (float smoothing : {0.f, 0.5f, 0.9f}) {
+        std::unique_ptr<SequencerCore> core = makeEngine(divisions);
+        GateLog log = runPerSample(*core, clock, smoothing);
+        for (int t = 0; t < SequencerCore::NUM_TRACKS; t++) {
+            CHECK(!log.rises[t].empty() && log.rises[t].back() < lastEdge + BEAT);
+        }
+        // The first beat has no measured period, so only its first step plays
+        CHECK_EQ(log.rises[0].size(), 12);
+        CHECK_EQ(log.rises[1].size(), 1 + 8 * 11);
+        CHECK_EQ(log.rises[2].size(), 1 + 2 * 11);
+    }
+}
+
+// Nothing steps between the first two edges, and the second beat starts on
+// the second edge whatever the engine's previous clock period
+TEST(pll_waits_for_measured_period) {
+    const int divisions[] = {DIV_1_4, DIV_1_8, DIV_1_32};
+    std::vector<int64_t> edges = {1000, 1000 + BEAT, 1000 + 2 * BEAT};
+    std::vector<float> clock = clockPulses(edges, 1000 + 3 * BEAT);
+    for (float smoothing : {0.f, 0.5f}) {
+        std::unique_ptr<SequencerCore> core = makeEngine(divisions);
+        GateLog log = runPerSample(*core, clock, smoothing);
+        for (int t = 0; t < SequencerCore::NUM_TRACKS; t++) {
+            CHECK(log.rises[t].size() >= 2);
+            if (log.rises[t].size() < 2)
+                continue;
+            CHECK_EQ(log.rises[t][0], edges[0]);
+            CHECK_EQ(log.rises[t][1], edges[1]);
+        }
+        // Measured from the second edge on (phase increments round down,
+        // so sub-steps may land a sample late)
+        CHECK(log.rises[1].size() >= 3);
+        if (log.rises[1].size() >= 3)
+            CHECK(log.rises[1][2] - (edges[1] + BEAT / 2) <= 1 && log.rises[1][2] >= edges[1] + BEAT / 2);
+    }
+}
+
+// Divided tracks step on the clock edges themselves, not on the smoothed
+// PLL beat, however much the clock jitters; multiplied tracks still play
+// every sub-step
+TEST(divided_tracks_step_on_jittered_edges) {
+    std::vector<int64_t> edges;
+    uint32_t random = 1;
+    for (int k = 0; k < 48; k++) {
+        random = random * 1103515245 + 12345;
+        int jitter = (int)((random >> 16) % 801) - 400;
+        edges.push_back(2000 + k * BEAT + jitter);
+    }
+    std::vector<float> clock = clockPulses(edges, edges.back() + 2 * BEAT);
+    const int dividedDivisions[] = {DIV_1_4, DIV_1_2, DIV_1_1};
+    const int everyEdges[] = {1, 2, 4};
+    for (float smoothing : {0.5f, 0.9f}) {
+        std::unique_ptr<SequencerCore> core = makeEngine(dividedDivisions);
+        GateLog log = runPerSample(*core, clock, smoothing);
+        for (int t = 0; t < SequencerCore::NUM_TRACKS; t++) {
+            // Counting starts after the step shown at reset, so a track
+            // dividing by n first steps on the n-th edge
+            std::vector<int64_t> expected;
+            for (size_t k = everyEdges[t] - 1; k < edges.size(); k += everyEdges[t]) {
+                expected.push_back(edges[k]);
+            }
+            CHECK(log.rises[t] == expected);
+        }
+
+        const int multipliedDivisions[] = {DIV_1_8, DIV_1_32, DIV_1_4};
+        core = makeEngine(multipliedDivisions);
+        log = runPerSample(*core, clock, smoothing);
+        CHECK_EQ(log.rises[0].size(), 1 + 2 * (edges.size() - 1));
+        CHECK_EQ(log.rises[1].size(), 1 + 8 * (edges.size() - 1));
+    }
+}
+
+// Block processing follows the PLL exactly like per-sample processing
+TEST(pll_block_matches_per_sample) {
+    const int divisions[] = {DIV_1_2, DIV_1_32, DIV_1_8};
+    std::vector<int64_t> edges;
+    int64_t edge = 700;
+    for (int k = 0; k < 40; k++) {
+        edges.push_back(edge);
+        // Tempo drifts, then the clock pauses for a while and comes back
+        edge += k == 20 ? 5 * BEAT : BEAT + (k % 5) * 300 - 600;
+    }
+    std::vector<float> clock = clockPulses(edges, edge + 2 * BEAT);
+    for (float smoothing : {0.f, 0.75f}) {
+        std::unique_ptr<SequencerCore> a = makeEngine(divisions);
+        std::unique_ptr<SequencerCore> b = makeEngine(divisions);
+        GateLog perSample = runPerSample(*a, clock, smoothing);
+        GateLog blocks = runBlocks(*b, clock, smoothing);
+        for (int t = 0; t < SequencerCore::NUM_TRACKS; t++) {
+            CHECK(perSample.rises[t] == blocks.rises[t]);
+        }
+    }
+}
@@ -0,0 +1,146 @@
+#include "test.hpp"
+#include "SceneHistory.hpp"
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <thread>
+#include <vector>
+
+static bool sameEngine(const SequencerCore& a, const SequencerCore& b) {
+    if (a.currentScene != b.currentScene || a.lockSeed != b.lockSeed || a.clockSmoothing != b.clockSmoothing)
+        return false;
+    for (int t = 0; t < SequencerCore::NUM_TRACKS; t++) {
+        if (a.quantizers[t].scale != b.quantizers[t].scale || a.quantizers[t].root != b.quantizers[t].root)
+            return false;
+    }
+    for (int i = 0; i < SequencerCore::NUM_SCENES; i++) {
+        if (a.scenes[i].isEmpty != b.scenes[i].isEmpty)
+            return false;
+        for (int t = 0; t < SequencerCore::NUM_TRACKS; t++) {
+            const SequencerCore::TrackData& x = a.scenes[i].tracks[t];
+            const SequencerCore::TrackData& y = b.scenes[i].tracks[t];
+            if (x.stepCount != y.stepCount || x.divisionIndex != y.divisionIndex || x.direction != y.direction
+                || x.seed != y.seed || x.gates != y.gates)
+                return false;
+            for (int s = 0; s < SequencerCore::NUM_STEPS; s++) {
+                if (x.pitches[s] != y.pitches[s])
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+static std::vector<Command> randomCommands(int count, uint32_t random) {
+    static const float SMOOTHINGS[] = {0.f, 0.5f, 0.75f, 0.9f, 1.f, -0.5f};
+    std::vector<Command> commands;
+    for (int k = 0; k < count; k++) {
+        random = random * 1103515245 + 12345;
+        uint32_t r = random >> 8;
+        Command command;
+        command.type = (CommandType)(r % (CMD_REDO + 1));
+        command.track = (r >> 4) % SequencerCore::NUM_TRACKS;
+        command.step = (r >> 6) % SequencerCore::NUM_STEPS;
+        command.scene = (r >> 9) % SequencerCore::NUM_SCENES;
+        command.stepCount = 1 + (r >> 12) % SequencerCore::NUM_STEPS;
+        command.divisionIndex = (r >> 15) % NUM_DIVISIONS;
+        command.direction = (Direction)((r >> 19) % 4);
+        command.pitch = (r >> 8) % (PITCH_CODE_MAX + 1);
+        command.seed = random;
+        command.amount = (int)((r >> 12) % 11) - 5;
+        command.scale = (r >> 4) & 0xFFF;
+        command.root = (r >> 16) % 12;
+        command.on = (r >> 21) & 1;
+        command.smoothing = SMOOTHINGS[(r >> 18) % 6];
+        commands.push_back(command);
+    }
+    return commands;
+}
+
+// Commands posted while the audio thread runs blocks leave the engine
+// exactly as applying them in order on one thread does. Run under
+// `make check SANITIZE=thread`.
+TEST(commands_posted_match_serial) {
+    std::vector<Command> commands = randomCommands(100000, 11);
+
+    std::unique_ptr<SequencerCore> serial(new SequencerCore);
+    std::unique_ptr<SequencerCore::History> serialHistory(new SequencerCore::History);
+    serial->history = serialHistory.get();
+    for (const Command& command : commands) {
+        serial->applyCommand(command);
+    }
+
+    std::unique_ptr<SequencerCore> core(new SequencerCore);
+    std::unique_ptr<SequencerCore::History> history(new SequencerCore::History);
+    core->history = history.get();
+    std::atomic<bool> done(false);
+    std::thread audio([&] {
+        SequencerCore::Inputs in;
+        SequencerCore::BlockInputs blockIn;
+        SequencerCore::BlockOutputs blockOut;
+        float pitch[64];
+        blockOut.pitch[0] = pitch;
+        while (!done.load() || !core->commands.empty()) {
+            core->processBlock(in, blockIn, blockOut, 64);
+        }
+    });
+    for (const Command& command : commands) {
+        while (!core->postCommand(command)) {
+            std::this_thread::yield();
+        }
+    }
+    done = true;
+    audio.join();
+    CHECK(sameEngine(*core, *serial));
+}
+
+// Out of range smoothing is ignored, the PLL would never correct at 1
+TEST(commands_clock_smoothing_range) {
+    std::unique_ptr<SequencerCore> core(new SequencerCore);
+    Command command;
+    command.type = CMD_SET_CLOCK_SMOOTHING;
+    command.smoothing = 0.9f;
+    core->applyCommand(command);
+    CHECK(core->clockSmoothing == 0.9f);
+    for (float smoothing : {1.f, -0.1f, NAN}) {
+        command.smoothing = smoothing;
+        core->applyCommand(command);
+        CHECK(core->clockSmoothing == 0.9f);
+    }
+}
+
+// A reader never sees a value the writer was halfway through publishing
+TEST(commands_seqlock_reads_whole_values) {
+    struct Value {
+        uint32_t words[37];
+    };
+    Seqlock<Value> seqlock;
+    std::atomic<bool> done(false);
+    std::atomic<long> reads(0);
+    std::atomic<long> torn(0);
+    std::thread reader([&] {
+        while (!done.load()) {
+            Value value = seqlock.read();
+            for (int i = 1; i < 37; i++) {
+                if (value.words[i] != value.words[0]) {
+                    torn++;
+                    break;
+                }
+            }
+            reads++;
+        }
+    });
+    while (reads.load() == 0) {
+        std::this_thread::yield();
+    }
+    for (uint32_t k = 1; k <= 200000; k++) {
+        Value value;
+        for (int i = 0; i < 37; i++) {
+            value.words[i] = k;
+        }
+        seqlock.write(value);
+    }
+    done = true;
+    reader.join();
+    CHECK_EQ(torn.load(), 0);
+}
@@ -0,0 +1,143 @@
+#include "test.hpp"
+#include "SceneHistory.hpp"
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Counts heap allocations while `countAllocations` is set. Only set while
+// no other test thread is running. Kept out of line so the compiler does
+// not pair the inlined malloc and free with new and delete expressions.
+static bool countAllocations = false;
+static long allocations = 0;
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    if (countAllocations)
+        allocations++;
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+typedef SequencerCore8x64 Engine;
+
+struct Bank {
+    Engine::SceneData scenes[Engine::NUM_SCENES];
+};
+
+static bool sameBank(const Engine::SceneData* a, const Engine::SceneData* b) {
+    for (int i = 0; i < Engine::NUM_SCENES; i++) {
+        if (a[i].isEmpty != b[i].isEmpty)
+            return false;
+        for (int t = 0; t < Engine::NUM_TRACKS; t++) {
+            const Engine::TrackData& x = a[i].tracks[t];
+            const Engine::TrackData& y = b[i].tracks[t];
+            if (x.stepCount != y.stepCount || x.divisionIndex != y.divisionIndex || x.direction != y.direction
+                || x.seed != y.seed || x.gates != y.gates)
+                return false;
+            for (int s = 0; s < Engine::NUM_STEPS; s++) {
+                if (x.pitches[s] != y.pitches[s])
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void randomEdit(Engine& core, uint32_t& random) {
+    random = random * 1103515245 + 12345;
+    uint32_t r = random >> 8;
+    int t = r % Engine::NUM_TRACKS;
+    int s = (r >> 4) % Engine::NUM_STEPS;
+    switch ((r >> 12) % 8) {
+        case 0: core.setPitch(t, s, (r >> 10) % (PITCH_CODE_MAX + 1)); break;
+        case 1: core.toggleGate(t, s); break;
+        case 2: core.setTrackSettings(t, 1 + s, (r >> 16) % NUM_DIVISIONS, (Direction)((r >> 20) % 4)); break;
+        case 3: core.setSeed(t, random); break;
+        case 4: core.rotateGates(t, (int)((r >> 16) % 9) - 4); break;
+        case 5: core.invertGates(t); break;
+        case 6: core.fillEuclid(t, s); break;
+        case 7:
+            if (r & 0x100000)
+                core.pressCopy();
+            else if (r & 0x200000)
+                core.pressDelete();
+            core.pressScene((r >> 16) % Engine::NUM_SCENES);
+            break;
+    }
+}
+
+// Undo walks back through the bank as it was before each recorded edit,
+// for exactly LEVELS levels, and redo walks forward to the final bank,
+// all without allocating
+TEST(history_undo_redo_matches_snapshots) {
+    std::unique_ptr<Engine> core(new Engine);
+    std::unique_ptr<Engine::History> history(new Engine::History);
+    core->history = history.get();
+
+    // Banks before each edit that recorded a level
+    std::vector<std::unique_ptr<Bank> > before;
+    uint32_t random = 3;
+    while (before.size() < 455) {
+        std::unique_ptr<Bank> bank(new Bank);
+        for (int i = 0; i < Engine::NUM_SCENES; i++) {
+            bank->scenes[i] = core->scenes[i];
+        }
+        int head = history->head;
+        int undoCount = history->undoCount;
+        countAllocations = true;
+        randomEdit(*core, random);
+        countAllocations = false;
+        if (history->head != head || history->undoCount != undoCount)
+            before.push_back(std::move(bank));
+    }
+    std::unique_ptr<Bank> last(new Bank);
+    for (int i = 0; i < Engine::NUM_SCENES; i++) {
+        last->scenes[i] = core->scenes[i];
+    }
+
+    countAllocations = true;
+    int undone = 0;
+    while (core->history->undoCount > 0) {
+        core->undo();
+        undone++;
+        CHECK(sameBank(core->scenes, before[before.size() - undone]->scenes));
+    }
+    CHECK(!core->undo());
+    int redone = 0;
+    while (core->history->redoCount > 0) {
+        core->redo();
+        redone++;
+        if (redone < undone)
+            CHECK(sameBank(core->scenes, before[before.size() - undone + redone]->scenes));
+    }
+    CHECK(!core->redo());
+    countAllocations = false;
+
+    CHECK_EQ(undone, Engine::History::LEVELS);
+    CHECK_EQ(redone, Engine::History::LEVELS);
+    CHECK(sameBank(core->scenes, last->scenes));
+    CHECK_EQ(allocations, 0);
+}
+
+// Turning one pitch knob through many values is one undo level
+TEST(history_knob_sweep_is_one_level) {
+    std::unique_ptr<Engine> core(new Engine);
+    std::unique_ptr<Engine::History> history(new Engine::History);
+    core->history = history.get();
+    core->toggleGate(0, 0);
+    CHECK_EQ(history->undoCount, 1);
+    for (int k = 1; k <= 100; k++) {
+        core->setPitch(0, 0, k * 40);
+    }
+    CHECK_EQ(history->undoCount, 2);
+    core->undo();
+    CHECK_EQ(core->scenes[0].tracks[0].pitches[0], 0);
+    core->redo();
+    CHECK_EQ(core->scenes[0].tracks[0].pitches[0], 4000);
+}
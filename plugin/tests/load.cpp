@@ -0,0 +1,166 @@
+#include "test.hpp"
+#include "SequencerJson.hpp"
+#include <atomic>
+#include <memory>
+#include <thread>
+
+// Patches a corrupt or hand-edited file could hold
+static const char* const HOSTILE_PATCHES[] = {
+    "{\"currentScene\": 99, \"scenes\": [{\"isEmpty\": false, \"tracks\": [{\"stepCount\": -5, \"divisionIndex\": 99,"
+    " \"direction\": 7, \"pitches\": [1e9, -3, \"x\", 2], \"gates\": [1, \"y\"]},"
+    " {\"stepCount\": 1000, \"divisionIndex\": -2, \"direction\": -1}]}]}",
+    "{\"version\": 2, \"currentScene\": -4, \"scenes\": 5, \"sceneBlobs\": [\"!!!\", 3, \"U1EBAwgA\", null]}",
+    "{\"version\": 99, \"sceneBlobs\": {}, \"quantizers\": [{\"scale\": 1e9, \"root\": -7}, 4]}",
+    "{\"currentScene\": 2.7, \"isRunning\": 3, \"scenes\": [null, {\"tracks\": [{\"divisionIndex\": 15.6, \"stepCount\": 3.2}]}]}",
+    "[1, 2, 3]",
+    "{}",
+};
+
+// Loads `text` and plays it for a while; everything must stay in range
+template <class Engine>
+static void checkHostileLoad(const char* text) {
+    json_t* rootJ = json_loads(text, 0, nullptr);
+    CHECK(rootJ != nullptr);
+    std::unique_ptr<Engine> core(new Engine);
+    engineFromJson(*core, rootJ);
+    json_decref(rootJ);
+
+    typename Engine::Inputs in;
+    typename Engine::Outputs out;
+    for (int i = 0; i < 100000; i++) {
+        core->process(in, out);
+        for (int t = 0; t < Engine::NUM_TRACKS; t++) {
+            CHECK(out.pitch[t] >= 0.f && out.pitch[t] <= 5.f);
+        }
+    }
+    CHECK(core->currentScene >= 0 && core->currentScene < Engine::NUM_SCENES);
+    for (int i = 0; i < Engine::NUM_SCENES; i++) {
+        for (int t = 0; t < Engine::NUM_TRACKS; t++) {
+            const typename Engine::TrackData& trackData = core->scenes[i].tracks[t];
+            CHECK(trackData.stepCount >= 1 && trackData.stepCount <= Engine::NUM_STEPS);
+            CHECK(trackData.divisionIndex >= 0 && trackData.divisionIndex < NUM_DIVISIONS);
+            CHECK(trackData.direction >= DIR_FORWARD && trackData.direction <= DIR_RANDOM);
+            for (int s = 0; s < Engine::NUM_STEPS; s++) {
+                CHECK(trackData.pitches[s] <= PITCH_CODE_MAX);
+            }
+        }
+    }
+}
+
+TEST(load_hostile_patches_clamp) {
+    for (const char* text : HOSTILE_PATCHES) {
+        checkHostileLoad<SequencerCore>(text);
+        checkHostileLoad<SequencerCore8x64>(text);
+    }
+}
+
+// A version 1 patch and its version 2 re-save play the same
+TEST(load_v1_resave_plays_the_same) {
+    const char* text =
+        "{\"currentScene\": 0, \"scenes\": [{\"isEmpty\": false, \"tracks\": ["
+        "{\"stepCount\": 5, \"divisionIndex\": 3, \"direction\": 2, \"seed\": 11,"
+        " \"pitches\": [0.5, 1.25, 4.0, 2.0, 3.3], \"gates\": [true, false, true, true, true]},"
+        "{\"stepCount\": 8, \"divisionIndex\": 5, \"direction\": 3, \"seed\": 12,"
+        " \"pitches\": [1.0, 2.0, 3.0, 4.0, 5.0, 0.0, 0.25, 0.75]},"
+        "{\"stepCount\": 3, \"divisionIndex\": 1, \"direction\": 1, \"seed\": 13, \"pitches\": [0.1, 0.2, 0.3]}]}]}";
+    json_t* v1J = json_loads(text, 0, nullptr);
+    CHECK(v1J != nullptr);
+    std::unique_ptr<SequencerCore> a(new SequencerCore);
+    engineFromJson(*a, v1J);
+    json_decref(v1J);
+
+    json_t* v2J = json_object();
+    engineToJson(*a, v2J);
+    std::unique_ptr<SequencerCore> b(new SequencerCore);
+    engineFromJson(*b, v2J);
+    json_decref(v2J);
+
+    a->randomSeed = b->randomSeed = 5;
+    SequencerCore::Inputs in;
+    SequencerCore::Outputs outA, outB;
+    for (int i = 0; i < 200000; i++) {
+        a->process(in, outA);
+        b->process(in, outB);
+        for (int t = 0; t < SequencerCore::NUM_TRACKS; t++) {
+            CHECK(outA.pitch[t] == outB.pitch[t] && outA.gate[t] == outB.gate[t]);
+        }
+    }
+}
+
+// Scene loaded from post k, different from its neighbours' so a state
+// mixed from two posts shows
+static int postedScene(uint32_t k) {
+    return (int)((k * 5 + 3) % SequencerCore::NUM_SCENES);
+}
+
+// States posted from another thread while the audio thread runs blocks are
+// loaded whole or dropped, and every one comes back to the poster exactly
+// once. Run under `make check SANITIZE=thread` or `SANITIZE=address`.
+TEST(load_posted_states_race_blocks) {
+    static const int POSTS = 20000;
+    std::unique_ptr<SequencerCore> core(new SequencerCore);
+    std::atomic<bool> started(false);
+    std::atomic<bool> done(false);
+    std::atomic<int> loads(0);
+    std::atomic<int> torn(0);
+    std::thread audio([&] {
+        SequencerCore::Inputs in;
+        SequencerCore::BlockInputs blockIn;
+        SequencerCore::BlockOutputs blockOut;
+        float pitch[64];
+        blockOut.pitch[0] = pitch;
+        bool loaded = false;
+        started = true;
+        while (!done.load()) {
+            if (core->processBlock(in, blockIn, blockOut, 64)) {
+                loads++;
+                loaded = true;
+            }
+            if (!loaded)
+                continue;
+            // Post k stores k in every track seed of every scene, and picks
+            // its current scene from k. Anything else is a mix of posts.
+            uint32_t k = core->scenes[0].tracks[0].seed;
+            bool whole = core->currentScene == postedScene(k);
+            for (int i = 0; i < SequencerCore::NUM_SCENES; i++) {
+                whole &= !core->scenes[i].isEmpty;
+                for (int t = 0; t < SequencerCore::NUM_TRACKS; t++) {
+                    whole &= core->scenes[i].tracks[t].seed == k;
+                }
+            }
+            if (!whole)
+                torn++;
+        }
+    });
+
+    while (!started.load()) {
+        std::this_thread::yield();
+    }
+    int returned = 0;
+    for (int k = 0; k < POSTS; k++) {
+        SequencerCore::PatchState* state = new SequencerCore::PatchState;
+        for (int i = 0; i < SequencerCore::NUM_SCENES; i++) {
+            state->scenes[i].isEmpty = false;
+            for (int t = 0; t < SequencerCore::NUM_TRACKS; t++) {
+                state->scenes[i].tracks[t].seed = (uint32_t)k;
+            }
+        }
+        state->currentScene = postedScene((uint32_t)k);
+        SequencerCore::PatchState* old = core->postState(state);
+        if (old)
+            returned++;
+        delete old;
+        // Give the audio thread a chance to take some of the posts
+        std::this_thread::yield();
+    }
+    done = true;
+    audio.join();
+    SequencerCore::PatchState* last = core->postState(nullptr);
+    if (last)
+        returned++;
+    delete last;
+
+    CHECK_EQ(returned, POSTS);
+    CHECK(loads.load() > 0 && loads.load() <= POSTS);
+    CHECK_EQ(torn.load(), 0);
+}
@@ -0,0 +1,36 @@
+#include "test.hpp"
+#include <cstring>
+#include <vector>
+
+TestCase*& testList() {
+    static TestCase* list = nullptr;
+    return list;
+}
+
+int& testFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+// Runs every test, or those whose names contain the first argument
+int main(int argc, char** argv) {
+    const char* filter = argc > 1 ? argv[1] : nullptr;
+    std::vector<TestCase*> tests;
+    for (TestCase* test = testList(); test; test = test->next) {
+        tests.insert(tests.begin(), test);
+    }
+    int run = 0;
+    int failedTests = 0;
+    for (TestCase* test : tests) {
+        if (filter && !std::strstr(test->name, filter))
+            continue;
+        int before = testFailures();
+        test->run();
+        run++;
+        bool failed = testFailures() != before;
+        failedTests += failed;
+        std::printf("%s %s\n", failed ? "FAIL" : "ok  ", test->name);
+    }
+    std::printf("%d tests, %d failed\n", run, failedTests);
+    return failedTests ? 1 : 0;
+}
@@ -0,0 +1,173 @@
+#include "test.hpp"
+#include "SequencerJson.hpp"
+#include "SequencerBlob.hpp"
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+template <class Engine>
+static bool sameScene(const typename Engine::SceneData& a, const typename Engine::SceneData& b) {
+    if (a.isEmpty != b.isEmpty)
+        return false;
+    for (int t = 0; t < Engine::NUM_TRACKS; t++) {
+        const typename Engine::TrackData& x = a.tracks[t];
+        const typename Engine::TrackData& y = b.tracks[t];
+        if (x.stepCount != y.stepCount || x.divisionIndex != y.divisionIndex || x.direction != y.direction
+            || x.seed != y.seed || x.gates != y.gates)
+            return false;
+        for (int s = 0; s < Engine::NUM_STEPS; s++) {
+            if (x.pitches[s] != y.pitches[s])
+                return false;
+        }
+    }
+    return true;
+}
+
+// Fills every scene with pseudo-random values in range
+template <class Engine>
+static void randomizeScenes(Engine& core, uint32_t random) {
+    for (int i = 0; i < Engine::NUM_SCENES; i++) {
+        core.scenes[i].isEmpty = i > 0 && (i % 3) == 0;
+        for (int t = 0; t < Engine::NUM_TRACKS; t++) {
+            typename Engine::TrackData& trackData = core.scenes[i].tracks[t];
+            random = random * 1103515245 + 12345;
+            trackData.stepCount = 1 + random % Engine::NUM_STEPS;
+            trackData.divisionIndex = (random >> 8) % NUM_DIVISIONS;
+            trackData.direction = (Direction)((random >> 16) % 4);
+            trackData.seed = random * 2654435761u;
+            uint64_t gates = 0;
+            for (int s = 0; s < Engine::NUM_STEPS; s++) {
+                random = random * 1103515245 + 12345;
+                trackData.pitches[s] = (uint16_t)((random >> 8) % (PITCH_CODE_MAX + 1));
+                if (random & 0x10000)
+                    gates |= stepBit(s);
+            }
+            trackData.gates = (typename Engine::TrackData::StepMask)gates;
+        }
+        core.touchScene(i);
+    }
+    core.syncLanes();
+}
+
+template <class Engine>
+static void checkRoundTrip(uint32_t random) {
+    std::unique_ptr<Engine> core(new Engine);
+    randomizeScenes(*core, random);
+    json_t* rootJ = json_object();
+    engineToJson(*core, rootJ);
+    CHECK(json_object_get(rootJ, "scenes") == nullptr);
+    std::unique_ptr<typename Engine::PatchState> state(new typename Engine::PatchState);
+    CHECK(patchStateFromJson<Engine>(*state, rootJ));
+    for (int i = 0; i < Engine::NUM_SCENES; i++) {
+        CHECK(sameScene<Engine>(state->scenes[i], core->scenes[i]));
+    }
+    json_decref(rootJ);
+}
+
+TEST(patch_blobs_round_trip) {
+    checkRoundTrip<SequencerCore>(1);
+    checkRoundTrip<SequencerCore4x16>(2);
+    checkRoundTrip<SequencerCore8x64>(3);
+}
+
+// Version 1 patches (no version field) load their JSON scenes
+TEST(patch_v1_scenes_migrate) {
+    const char* text =
+        "{\"currentScene\": 1, \"scenes\": ["
+        "{\"isEmpty\": false, \"tracks\": []},"
+        "{\"isEmpty\": false, \"tracks\": [{\"stepCount\": 5, \"divisionIndex\": 4, \"direction\": 2, \"seed\": 77,"
+        " \"pitches\": [1.0, 2.5, 9.0, -1.0], \"gates\": [false, true, false]}]}]}";
+    json_t* rootJ = json_loads(text, 0, nullptr);
+    CHECK(rootJ != nullptr);
+    std::unique_ptr<SequencerCore::PatchState> state(new SequencerCore::PatchState);
+    CHECK(patchStateFromJson<SequencerCore>(*state, rootJ));
+    const SequencerCore::TrackData& trackData = state->scenes[1].tracks[0];
+    CHECK_EQ(state->currentScene, 1);
+    CHECK_EQ(trackData.stepCount, 5);
+    CHECK_EQ(trackData.divisionIndex, 4);
+    CHECK_EQ(trackData.direction, DIR_PENDULUM);
+    CHECK_EQ(trackData.seed, 77);
+    CHECK_EQ(trackData.pitches[0], pitchToCode(1.f));
+    CHECK_EQ(trackData.pitches[1], pitchToCode(2.5f));
+    CHECK_EQ(trackData.pitches[2], PITCH_CODE_MAX);
+    CHECK_EQ(trackData.pitches[3], 0);
+    // Steps past the stored gates keep the default (on)
+    CHECK_EQ(trackData.gates, 0xFA);
+    json_decref(rootJ);
+}
+
+// Each version reads only its own scene field
+TEST(patch_version_selects_scene_field) {
+    std::unique_ptr<SequencerCore> core(new SequencerCore);
+    randomizeScenes(*core, 4);
+    json_t* rootJ = json_object();
+    engineToJson(*core, rootJ);
+    // A stray v1 field in a v2 patch is ignored
+    json_t* scenesJ = json_array();
+    json_t* sceneJ = json_object();
+    json_object_set_new(sceneJ, "isEmpty", json_false());
+    json_array_append_new(scenesJ, sceneJ);
+    json_object_set_new(rootJ, "scenes", scenesJ);
+    std::unique_ptr<SequencerCore::PatchState> state(new SequencerCore::PatchState);
+    CHECK(patchStateFromJson<SequencerCore>(*state, rootJ));
+    CHECK(sameScene<SequencerCore>(state->scenes[1], core->scenes[1]));
+
+    // Blobs in a patch without a version are not read
+    json_object_set_new(rootJ, "version", json_integer(1));
+    CHECK(patchStateFromJson<SequencerCore>(*state, rootJ));
+    CHECK(sameScene<SequencerCore>(state->scenes[2], SequencerCore::SceneData()));
+    json_decref(rootJ);
+}
+
+template <class Engine>
+static std::string saveText(const Engine& core, SceneJsonCache<Engine>* cache) {
+    json_t* rootJ = json_object();
+    engineToJson(core, rootJ, cache);
+    char* text = json_dumps(rootJ, 0);
+    std::string result(text);
+    free(text);
+    json_decref(rootJ);
+    return result;
+}
+
+// Saves reusing cached scene JSON match fresh saves after every kind of edit
+TEST(patch_cached_save_matches_fresh) {
+    typedef SequencerCore8x64 Engine;
+    std::unique_ptr<Engine> core(new Engine);
+    std::unique_ptr<SceneJsonCache<Engine> > cache(new SceneJsonCache<Engine>);
+    std::unique_ptr<Engine> source(new Engine);
+    std::unique_ptr<Engine::PatchState> state(new Engine::PatchState);
+    uint32_t random = 7;
+    for (int k = 0; k < 2000; k++) {
+        random = random * 1103515245 + 12345;
+        uint32_t r = random >> 8;
+        int t = r % Engine::NUM_TRACKS;
+        int s = (r >> 4) % Engine::NUM_STEPS;
+        switch ((r >> 12) % 10) {
+            case 0: core->setPitch(t, s, (r >> 10) % (PITCH_CODE_MAX + 1)); break;
+            case 1: core->toggleGate(t, s); break;
+            case 2: core->setTrackSettings(t, 1 + s, (r >> 16) % NUM_DIVISIONS, (Direction)((r >> 20) % 4)); break;
+            case 3: core->setSeed(t, random); break;
+            case 4: core->rotateGates(t, (int)((r >> 16) % 9) - 4); break;
+            case 5: core->fillEuclid(t, s); break;
+            case 6: core->undo(); break;
+            case 7: core->redo(); break;
+            case 8:
+                if (r & 0x100000)
+                    core->pressCopy();
+                else if (r & 0x200000)
+                    core->pressDelete();
+                core->pressScene((r >> 16) % Engine::NUM_SCENES);
+                break;
+            case 9:
+                // Loaded scenes must count as edited too
+                randomizeScenes(*source, random);
+                for (int i = 0; i < Engine::NUM_SCENES; i++) {
+                    state->scenes[i] = source->scenes[i];
+                }
+                core->loadState(*state);
+                break;
+        }
+        CHECK(saveText(*core, cache.get()) == saveText(*core, (SceneJsonCache<Engine>*)nullptr));
+    }
+}
@@ -0,0 +1,92 @@
+#include "test.hpp"
+#include "SequencerCore.hpp"
+#include <initializer_list>
+#include <memory>
+
+typedef SequencerCore8x64 Engine;
+
+// One track per ratio: whole, quarter, triplet and 32nd subdivisions and
+// polyrhythms, each with its own step count
+static const int SEEK_DIVISIONS[Engine::NUM_TRACKS] = {0, 2, 4, 7, 8, 9, 13, 15};
+static const int SEEK_STEP_COUNTS[Engine::NUM_TRACKS] = {5, 64, 7, 13, 1, 32, 9, 2};
+
+static std::unique_ptr<Engine> makeSeekEngine(Direction direction) {
+    std::unique_ptr<Engine> core(new Engine);
+    for (int t = 0; t < Engine::NUM_TRACKS; t++) {
+        core->setTrackSettings(t, SEEK_STEP_COUNTS[t], SEEK_DIVISIONS[t], direction);
+    }
+    return core;
+}
+
+// seek() lands every track where playback from a reset has it at the same
+// song position, in every direction, with swing on
+TEST(seek_matches_playback) {
+    for (Direction direction : {DIR_FORWARD, DIR_REVERSE, DIR_PENDULUM, DIR_RANDOM}) {
+        std::unique_ptr<Engine> played = makeSeekEngine(direction);
+        played->resetPlayback();
+        Engine::Inputs in;
+        in.sampleRate = 48000.f;
+        in.bpm = 97.f + direction * 31.f;
+        in.swing = 0.4f;
+        Engine::Outputs out;
+
+        uint32_t random = 5 + direction;
+        int64_t beat = 0;
+        uint64_t lastPhase = played->internalClockPhase;
+        for (int position = 0; position < 200; position++) {
+            random = random * 1103515245 + 12345;
+            int64_t samples = 1000 + (random >> 8) % 100000;
+            for (int64_t i = 0; i < samples; i++) {
+                played->process(in, out);
+                if (played->internalClockPhase < lastPhase)
+                    beat++;
+                lastPhase = played->internalClockPhase;
+            }
+
+            std::unique_ptr<Engine> sought = makeSeekEngine(direction);
+            sought->randomSeed = played->randomSeed;
+            sought->seek(beat, (double)played->internalClockPhase / 18446744073709551616.0);
+            for (int t = 0; t < Engine::NUM_TRACKS; t++) {
+                CHECK_EQ(sought->currentStep[t], played->currentStep[t]);
+                CHECK_EQ(sought->orderIndex[t], played->orderIndex[t]);
+                CHECK_EQ(sought->stepCounter[t], played->stepCounter[t]);
+                CHECK_EQ(sought->lanes.cycleBeat[t], played->lanes.cycleBeat[t]);
+                CHECK_EQ(sought->lanes.cycleStep[t], played->lanes.cycleStep[t]);
+                CHECK_EQ(sought->stepParity[t], played->stepParity[t]);
+            }
+        }
+    }
+}
+
+// Initialize clears playback like a new engine: with the seeds locked
+// again, random playback repeats a fresh engine's exactly, and the patch
+// settings are back to their defaults
+TEST(seek_clear_restarts_like_new) {
+    std::unique_ptr<Engine> fresh = makeSeekEngine(DIR_RANDOM);
+    std::unique_ptr<Engine> cleared = makeSeekEngine(DIR_RANDOM);
+    Engine::Inputs in;
+    in.sampleRate = 48000.f;
+    in.bpm = 150.f;
+    Engine::Outputs out;
+    cleared->lockSeed = true;
+    cleared->clockSmoothing = 0.9f;
+    for (int i = 0; i < 300000; i++) {
+        cleared->process(in, out);
+    }
+
+    cleared->clear();
+    CHECK(!cleared->lockSeed);
+    CHECK(cleared->clockSmoothing == DEFAULT_CLOCK_SMOOTHING);
+    for (int t = 0; t < Engine::NUM_TRACKS; t++) {
+        CHECK_EQ(cleared->stepCounter[t], 0);
+        cleared->setTrackSettings(t, SEEK_STEP_COUNTS[t], SEEK_DIVISIONS[t], DIR_RANDOM);
+    }
+    fresh->lockSeed = cleared->lockSeed = true;
+    for (int i = 0; i < 300000; i++) {
+        fresh->process(in, out);
+        cleared->process(in, out);
+        for (int t = 0; t < Engine::NUM_TRACKS; t++) {
+            CHECK_EQ(cleared->currentStep[t], fresh->currentStep[t]);
+        }
+    }
+}
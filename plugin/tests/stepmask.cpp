@@ -0,0 +1,106 @@
+#include "test.hpp"
+#include "SequencerCore.hpp"
+#include <memory>
+#include <vector>
+
+// Gate edits on the engine agree with the same edits on a bool per step,
+// for every mask width
+template <class Engine>
+static void checkGateEdits(int edits, uint32_t random) {
+    std::unique_ptr<Engine> core(new Engine);
+    bool reference[Engine::NUM_TRACKS][Engine::NUM_STEPS];
+    for (int t = 0; t < Engine::NUM_TRACKS; t++) {
+        for (int s = 0; s < Engine::NUM_STEPS; s++) {
+            reference[t][s] = core->track(t).gate(s);
+        }
+    }
+    for (int k = 0; k < edits; k++) {
+        random = random * 1103515245 + 12345;
+        uint32_t r = random >> 8;
+        int t = r % Engine::NUM_TRACKS;
+        bool* gates = reference[t];
+        int n = core->track(t).stepCount;
+        switch ((r >> 4) % 5) {
+            case 0: {
+                int s = (r >> 8) % Engine::NUM_STEPS;
+                core->toggleGate(t, s);
+                gates[s] = !gates[s];
+                break;
+            }
+            case 1: {
+                int amount = (int)((r >> 8) % 301) - 150;
+                core->rotateGates(t, amount);
+                bool rotated[Engine::NUM_STEPS];
+                for (int s = 0; s < n; s++) {
+                    rotated[((s + amount) % n + n) % n] = gates[s];
+                }
+                for (int s = 0; s < n; s++) {
+                    gates[s] = rotated[s];
+                }
+                break;
+            }
+            case 2: {
+                core->invertGates(t);
+                for (int s = 0; s < n; s++) {
+                    gates[s] = !gates[s];
+                }
+                break;
+            }
+            case 3: {
+                int pulses = (int)((r >> 8) % (Engine::NUM_STEPS + 3)) - 1;
+                core->fillEuclid(t, pulses);
+                // A pulse on step 0 and wherever the line from 0 to
+                // `pulses` over n steps reaches a new whole number
+                int p = pulses < 0 ? 0 : pulses > n ? n : pulses;
+                for (int s = 0; s < n; s++) {
+                    gates[s] = p > 0 && (s == 0 || (s * p) / n != ((s - 1) * p) / n);
+                }
+                break;
+            }
+            case 4:
+                core->setTrackSettings(t, 1 + (r >> 8) % Engine::NUM_STEPS, core->track(t).divisionIndex,
+                    core->track(t).direction);
+                break;
+        }
+        for (int s = 0; s < Engine::NUM_STEPS; s++) {
+            CHECK(core->track(t).gate(s) == gates[s]);
+        }
+    }
+}
+
+TEST(stepmask_gate_edits_match_reference) {
+    checkGateEdits<SequencerCore>(200000, 1);
+    checkGateEdits<SequencerCore4x16>(200000, 2);
+    checkGateEdits<SequencerCore8x64>(200000, 3);
+}
+
+// Euclidean fills hold exactly the asked pulses, the first on step 0, with
+// gaps between pulses (around the loop) that differ by at most one step
+TEST(stepmask_euclid_spreads_evenly) {
+    for (int n = 1; n <= 64; n++) {
+        for (int pulses = 0; pulses <= n; pulses++) {
+            uint64_t mask = euclidSteps(pulses, n);
+            CHECK_EQ(mask & ~firstSteps(n), 0);
+            std::vector<int> onsets;
+            for (int s = 0; s < n; s++) {
+                if (mask & stepBit(s))
+                    onsets.push_back(s);
+            }
+            CHECK_EQ(onsets.size(), pulses);
+            if (pulses == 0)
+                continue;
+            CHECK_EQ(onsets[0], 0);
+            int shortest = n, longest = 0;
+            for (size_t i = 0; i < onsets.size(); i++) {
+                int next = i + 1 < onsets.size() ? onsets[i + 1] : onsets[0] + n;
+                int gap = next - onsets[i];
+                shortest = gap < shortest ? gap : shortest;
+                longest = gap > longest ? gap : longest;
+            }
+            CHECK(longest - shortest <= 1);
+        }
+    }
+    // x..x..x. and x.x.xx.x (bit 0 is the first step)
+    CHECK_EQ(euclidSteps(3, 8), 0x49);
+    CHECK_EQ(euclidSteps(5, 8), 0xB5);
+}
@@ -0,0 +1,47 @@
+#pragma once
+// Minimal harness for the headless regression tests. TEST(name) defines and
+// registers a test; CHECK() reports a failed condition and carries on, so
+// one run lists every failure.
+#include <cstdio>
+
+struct TestCase {
+    const char* name;
+    void (*run)();
+    TestCase* next;
+};
+
+// Registered tests, in reverse order of registration
+TestCase*& testList();
+// Failed checks so far
+int& testFailures();
+
+struct TestRegistrar {
+    explicit TestRegistrar(TestCase* test) {
+        test->next = testList();
+        testList() = test;
+    }
+};
+
+#define TEST(name) \
+    static void test_##name(); \
+    static TestCase testCase_##name = {#name, test_##name, nullptr}; \
+    static TestRegistrar testRegistrar_##name(&testCase_##name); \
+    static void test_##name()
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            testFailures()++; \
+        } \
+    } while (0)
+
+// Integer comparison that prints both values on failure
+#define CHECK_EQ(a, b) \
+    do { \
+        long long checkA = (long long)(a), checkB = (long long)(b); \
+        if (checkA != checkB) { \
+            std::printf("%s:%d: check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #a, #b, checkA, checkB); \
+            testFailures()++; \
+        } \
+    } while (0)
@@ -0,0 +1,253 @@
+// Per-sample cost benchmark for the SequencerCore hot path.
+//
+// Runs the engine headless, at any of its sizes, across every direction
+// mode, clock division, swing on/off and internal/external clock at
+// several sample rates, and reports ns/sample, samples/sec and the p99
+// cost of a processing block.
+// Only the engine is measured; the Rack adapter (param polling, lights)
+// is not part of this number.
+
+#include "SequencerCore.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static const float SAMPLE_RATES[] = {44100.f, 48000.f, 96000.f, 192000.f};
+static const int NUM_SAMPLE_RATES = 4;
+
+static const char* DIRECTION_NAMES[] = {"fwd", "rev", "pend", "rand"};
+
+struct BenchConfig {
+    float sampleRate;
+    bool externalClock;
+    Direction direction;
+    int divisionIndex;
+    bool swing;
+};
+
+enum BenchMode {
+    MODE_SAMPLE,  // SequencerCore::process() once per sample, as the Rack module does
+    MODE_BLOCK    // SequencerCore::processBlock(), event-scheduled
+};
+
+struct BenchResult {
+    double nsPerSample;
+    double samplesPerSec;
+    double p99BlockNs;
+};
+
+template <class Engine>
+static void setupScenes(Engine& core, const BenchConfig& config) {
+    uint32_t seed = 12345;
+    for (int t = 0; t < Engine::NUM_TRACKS; t++) {
+        typename Engine::TrackData& trackData = core.scenes[0].tracks[t];
+        trackData.stepCount = Engine::NUM_STEPS - t % Engine::NUM_STEPS;
+        trackData.divisionIndex = config.divisionIndex;
+        trackData.direction = config.direction;
+        trackData.gates = 0;
+        for (int s = 0; s < Engine::NUM_STEPS; s++) {
+            seed = seed * 1664525u + 1013904223u;
+            trackData.pitches[s] = (uint16_t)((seed >> 8) % (PITCH_CODE_MAX + 1));
+            if ((s + t) % 3 != 0)
+                trackData.gates |= (typename Engine::TrackData::StepMask)stepBit(s);
+        }
+    }
+    core.syncLanes();
+}
+
+template <class Engine>
+static BenchResult runConfig(const BenchConfig& config, BenchMode mode, long numSamples, int blockSize) {
+    const int NUM_TRACKS = Engine::NUM_TRACKS;
+    Engine core;
+    setupScenes(core, config);
+
+    typename Engine::Inputs in;
+    in.sampleRate = config.sampleRate;
+    in.bpm = 120.f;
+    in.swing = config.swing ? 0.6f : 0.f;
+    in.pulseWidth = 0.5f;
+    in.clockConnected = config.externalClock;
+
+    // External clock: 120 BPM square-ish pulse with a 5 ms high time
+    int clockPeriodSamples = (int)(config.sampleRate * 0.5f);
+    int clockHighSamples = (int)(config.sampleRate * 0.005f);
+    int clockCounter = 0;
+
+    typename Engine::Outputs out;
+    long numBlocks = numSamples / blockSize;
+    std::vector<double> blockNs((size_t)numBlocks);
+    float sink = 0.f;
+
+    std::vector<float> clockBuffer((size_t)blockSize);
+    std::vector<float> outputBuffer((size_t)blockSize * 2 * NUM_TRACKS);
+    typename Engine::BlockInputs blockIn;
+    typename Engine::BlockOutputs blockOut;
+    if (config.externalClock)
+        blockIn.clock = clockBuffer.data();
+    for (int t = 0; t < NUM_TRACKS; t++) {
+        blockOut.pitch[t] = &outputBuffer[(size_t)(2 * t) * blockSize];
+        blockOut.gate[t] = &outputBuffer[(size_t)(2 * t + 1) * blockSize];
+    }
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    for (long b = 0; b < numBlocks; b++) {
+        Clock::time_point blockStart = Clock::now();
+        if (config.externalClock) {
+            for (int i = 0; i < blockSize; i++) {
+                clockBuffer[i] = (clockCounter < clockHighSamples) ? 10.f : 0.f;
+                if (++clockCounter >= clockPeriodSamples)
+                    clockCounter = 0;
+            }
+        }
+        if (mode == MODE_BLOCK) {
+            core.processBlock(in, blockIn, blockOut, blockSize);
+            sink += blockOut.pitch[0][0] + blockOut.gate[NUM_TRACKS - 1][blockSize - 1];
+        } else {
+            for (int i = 0; i < blockSize; i++) {
+                in.clock = clockBuffer[i];
+                core.process(in, out);
+                sink += out.pitch[0] + (out.gate[NUM_TRACKS - 1] ? 1.f : 0.f);
+            }
+        }
+        Clock::time_point blockEnd = Clock::now();
+        blockNs[(size_t)b] = std::chrono::duration<double, std::nano>(blockEnd - blockStart).count();
+    }
+    Clock::time_point end = Clock::now();
+
+    // Keep the optimizer from discarding the work
+    if (sink == -1.f)
+        std::printf("%f\n", sink);
+
+    double totalNs = std::chrono::duration<double, std::nano>(end - start).count();
+    long processed = numBlocks * blockSize;
+
+    size_t p99Index = (size_t)(blockNs.size() * 0.99);
+    if (p99Index >= blockNs.size())
+        p99Index = blockNs.size() - 1;
+    std::nth_element(blockNs.begin(), blockNs.begin() + p99Index, blockNs.end());
+
+    BenchResult result;
+    result.nsPerSample = totalNs / processed;
+    result.samplesPerSec = processed / (totalNs * 1e-9);
+    result.p99BlockNs = blockNs[p99Index];
+    return result;
+}
+
+// Engine sizes to choose from (tracks x steps x scenes)
+typedef BenchResult (*RunFunction)(const BenchConfig& config, BenchMode mode, long numSamples, int blockSize);
+
+struct BenchModel {
+    const char* name;
+    RunFunction run;
+};
+
+static const BenchModel MODELS[] = {
+    {"3x8x8", runConfig<SequencerCore>},
+    {"4x16x16", runConfig<SequencerCore4x16>},
+    {"8x64x32", runConfig<SequencerCore8x64>}
+};
+static const int NUM_MODELS = 3;
+
+static void printUsage(const char* argv0) {
+    std::printf("Usage: %s [--model M] [--mode sample|block] [--samples N] [--block N] [--rate HZ]\n", argv0);
+    std::printf("  --model M    engine size: 3x8x8 (default), 4x16x16 or 8x64x32\n");
+    std::printf("  --mode M     per-sample process() or event-scheduled processBlock() (default sample)\n");
+    std::printf("  --samples N  samples per configuration (default 1048576)\n");
+    std::printf("  --block N    block size used for p99 timing (default 64)\n");
+    std::printf("  --rate HZ    only run one sample rate\n");
+}
+
+int main(int argc, char** argv) {
+    long numSamples = 1L << 20;
+    int blockSize = 64;
+    float onlyRate = 0.f;
+    BenchMode mode = MODE_SAMPLE;
+    const BenchModel* model = &MODELS[0];
+
+    for (int i = 1; i < argc; i++) {
+        if (!std::strcmp(argv[i], "--mode") && i + 1 < argc) {
+            const char* name = argv[++i];
+            if (!std::strcmp(name, "sample")) {
+                mode = MODE_SAMPLE;
+            } else if (!std::strcmp(name, "block")) {
+                mode = MODE_BLOCK;
+            } else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (!std::strcmp(argv[i], "--model") && i + 1 < argc) {
+            const char* name = argv[++i];
+            model = nullptr;
+            for (int m = 0; m < NUM_MODELS; m++) {
+                if (!std::strcmp(name, MODELS[m].name))
+                    model = &MODELS[m];
+            }
+            if (!model) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (!std::strcmp(argv[i], "--samples") && i + 1 < argc) {
+            numSamples = std::atol(argv[++i]);
+        } else if (!std::strcmp(argv[i], "--block") && i + 1 < argc) {
+            blockSize = std::atoi(argv[++i]);
+        } else if (!std::strcmp(argv[i], "--rate") && i + 1 < argc) {
+            onlyRate = (float)std::atof(argv[++i]);
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (numSamples < blockSize || blockSize < 1) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::printf("# model: %s, mode: %s, block size %d\n", model->name, mode == MODE_BLOCK ? "block" : "sample", blockSize);
+    std::printf("%-8s %-5s %-5s %-6s %-5s %10s %12s %14s\n",
+        "rate", "clock", "dir", "div", "swing", "ns/sample", "Msamples/s", "p99 ns/block");
+
+    for (int r = 0; r < NUM_SAMPLE_RATES; r++) {
+        float sampleRate = SAMPLE_RATES[r];
+        if (onlyRate > 0.f && sampleRate != onlyRate)
+            continue;
+
+        double totalNsPerSample = 0.;
+        double worstP99 = 0.;
+        int count = 0;
+
+        for (int clock = 0; clock < 2; clock++) {
+            for (int dir = 0; dir < 4; dir++) {
+                for (int div = 0; div < NUM_DIVISIONS; div++) {
+                    for (int swing = 0; swing < 2; swing++) {
+                        BenchConfig config;
+                        config.sampleRate = sampleRate;
+                        config.externalClock = clock == 1;
+                        config.direction = (Direction)dir;
+                        config.divisionIndex = div;
+                        config.swing = swing == 1;
+
+                        BenchResult result = model->run(config, mode, numSamples, blockSize);
+                        std::printf("%-8.0f %-5s %-5s %-6s %-5s %10.2f %12.2f %14.0f\n",
+                            sampleRate, clock ? "ext" : "int", DIRECTION_NAMES[dir],
+                            DIVISIONS[div].name, swing ? "on" : "off",
+                            result.nsPerSample, result.samplesPerSec * 1e-6, result.p99BlockNs);
+
+                        totalNsPerSample += result.nsPerSample;
+                        worstP99 = std::max(worstP99, result.p99BlockNs);
+                        count++;
+                    }
+                }
+            }
+        }
+
+        double meanNs = totalNsPerSample / count;
+        std::printf("# %.0f Hz: mean %.2f ns/sample, %.2f Msamples/s, %.1fx realtime, worst p99 %.0f ns/block\n",
+            sampleRate, meanNs, 1e3 / meanNs, 1e9 / meanNs / sampleRate, worstP99);
+    }
+    return 0;
+}
@@ -0,0 +1,528 @@
+// Offline renderer for saved Sequencer patches.
+//
+// Loads the state the Sequencer module saves (its "data" object, or a
+// module or preset object holding one) and renders the pitch, gate and
+// scene CV outputs for a number of bars, as fast as the engine runs and
+// without Rack. Output is CSV, raw interleaved 32-bit floats or a 32-bit
+// float WAV file with one channel per output, in this order:
+// pitch 1, gate 1, pitch 2, gate 2, ..., scene CV.
+// The sequencer always plays, whatever run state the patch was saved in.
+//
+// Batch mode renders every patch in a directory to one output file each,
+// spread over all cores, and reports the aggregate throughput.
+
+#include "SequencerCore.hpp"
+#include "SequencerJson.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+enum OutputFormat {
+    FORMAT_CSV,
+    FORMAT_RAW,  // interleaved native-endian float32
+    FORMAT_WAV   // float32 WAVE
+};
+
+enum ClockSource {
+    CLOCK_INTERNAL,  // the engine's own clock at --bpm
+    CLOCK_EXTERNAL   // a generated pulse train at --bpm into the clock input
+};
+
+struct RenderConfig {
+    const char* inputPath = nullptr;
+    const char* outputPath = nullptr;
+    OutputFormat format = FORMAT_CSV;
+    bool formatGiven = false;
+    float sampleRate = 48000.f;
+    float bpm = 120.f;
+    ClockSource clock = CLOCK_INTERNAL;
+    float clockSmoothing = DEFAULT_CLOCK_SMOOTHING;
+    float swing = 0.f;        // percent, as on the panel
+    float pulseWidth = 50.f;  // percent, as on the panel
+    double bars = 4.0;
+    int beatsPerBar = 4;
+    long startBar = 0;
+    int scene = -1;
+    bool quiet = false;
+    // Batch mode: inputPath and outputPath are directories
+    bool batch = false;
+    int jobs = 0;
+};
+
+struct RenderStats {
+    int64_t frames = 0;
+    double seconds = 0.0;
+};
+
+// External clock pulse length
+static const float CLOCK_PULSE_SECONDS = 0.005f;
+static const int BLOCK_SIZE = 1024;
+
+// Output file writer for the three formats
+struct OutputWriter {
+    FILE* file = nullptr;
+    OutputFormat format = FORMAT_CSV;
+    int channels = 0;
+    float sampleRate = 48000.f;
+    int64_t frames = 0;
+
+    bool open(const char* path, OutputFormat outputFormat, int numChannels, float rate, int numTracks) {
+        file = std::fopen(path, outputFormat == FORMAT_CSV ? "w" : "wb");
+        if (!file)
+            return false;
+        format = outputFormat;
+        channels = numChannels;
+        sampleRate = rate;
+        if (format == FORMAT_CSV) {
+            std::fprintf(file, "sample");
+            for (int t = 0; t < numTracks; t++) {
+                std::fprintf(file, ",pitch%d,gate%d", t + 1, t + 1);
+            }
+            std::fprintf(file, ",scene\n");
+        } else if (format == FORMAT_WAV) {
+            // Sizes are filled in by close()
+            writeWavHeader(0);
+        }
+        return true;
+    }
+
+    void write(const float* interleaved, int n) {
+        if (format == FORMAT_CSV) {
+            for (int i = 0; i < n; i++) {
+                std::fprintf(file, "%lld", (long long)(frames + i));
+                for (int c = 0; c < channels; c++) {
+                    std::fprintf(file, ",%.9g", interleaved[i * channels + c]);
+                }
+                std::fputc('\n', file);
+            }
+        } else {
+            std::fwrite(interleaved, sizeof(float), (size_t)n * channels, file);
+        }
+        frames += n;
+    }
+
+    bool close() {
+        if (format == FORMAT_WAV) {
+            std::fseek(file, 0, SEEK_SET);
+            writeWavHeader(frames);
+        }
+        bool ok = !std::ferror(file);
+        return std::fclose(file) == 0 && ok;
+    }
+
+    void writeU32(uint32_t x) {
+        unsigned char bytes[4] = {(unsigned char)x, (unsigned char)(x >> 8), (unsigned char)(x >> 16), (unsigned char)(x >> 24)};
+        std::fwrite(bytes, 1, 4, file);
+    }
+
+    void writeU16(uint16_t x) {
+        unsigned char bytes[2] = {(unsigned char)x, (unsigned char)(x >> 8)};
+        std::fwrite(bytes, 1, 2, file);
+    }
+
+    void writeWavHeader(int64_t numFrames) {
+        uint32_t dataBytes = (uint32_t)std::min(numFrames * channels * 4, (int64_t)UINT32_MAX - 36);
+        std::fwrite("RIFF", 1, 4, file);
+        writeU32(36 + dataBytes);
+        std::fwrite("WAVEfmt ", 1, 8, file);
+        writeU32(16);
+        writeU16(3);  // IEEE float
+        writeU16((uint16_t)channels);
+        writeU32((uint32_t)sampleRate);
+        writeU32((uint32_t)sampleRate * channels * 4);
+        writeU16((uint16_t)(channels * 4));
+        writeU16(32);
+        std::fwrite("data", 1, 4, file);
+        writeU32(dataBytes);
+    }
+};
+
+template <class Engine>
+static bool render(const RenderConfig& config, const json_t* dataJ, const char* outputPath, RenderStats& stats) {
+    const int NUM_TRACKS = Engine::NUM_TRACKS;
+    const int CHANNELS = 2 * NUM_TRACKS + 1;
+
+    Engine* core = new Engine;
+    engineFromJson(*core, dataJ);
+    core->isRunning = true;
+    core->clockSmoothing = config.clockSmoothing;
+    if (config.scene >= 0 && config.scene < Engine::NUM_SCENES && !core->scenes[config.scene].isEmpty) {
+        core->currentScene = config.scene;
+        core->syncLanes();
+    }
+    core->seek(config.startBar * config.beatsPerBar);
+
+    typename Engine::Inputs in;
+    in.sampleRate = config.sampleRate;
+    in.bpm = config.bpm;
+    in.swing = config.swing / 100.f;
+    in.pulseWidth = config.pulseWidth / 100.f;
+    in.clockConnected = config.clock == CLOCK_EXTERNAL;
+
+    double beatSamples = 60.0 * config.sampleRate / config.bpm;
+    int64_t totalFrames = (int64_t)(config.bars * config.beatsPerBar * beatSamples + 0.5);
+    int64_t clockPulseSamples = std::max((int64_t)(CLOCK_PULSE_SECONDS * config.sampleRate), (int64_t)1);
+
+    OutputWriter writer;
+    if (!writer.open(outputPath, config.format, CHANNELS, config.sampleRate, NUM_TRACKS)) {
+        std::fprintf(stderr, "Cannot open %s for writing\n", outputPath);
+        delete core;
+        return false;
+    }
+
+    std::vector<float> clockBuffer(BLOCK_SIZE);
+    std::vector<float> planar((size_t)BLOCK_SIZE * CHANNELS);
+    std::vector<float> interleaved((size_t)BLOCK_SIZE * CHANNELS);
+    typename Engine::BlockInputs blockIn;
+    typename Engine::BlockOutputs blockOut;
+    if (in.clockConnected)
+        blockIn.clock = clockBuffer.data();
+    for (int t = 0; t < NUM_TRACKS; t++) {
+        blockOut.pitch[t] = &planar[(size_t)(2 * t) * BLOCK_SIZE];
+        blockOut.gate[t] = &planar[(size_t)(2 * t + 1) * BLOCK_SIZE];
+    }
+    blockOut.sceneCv = &planar[(size_t)(CHANNELS - 1) * BLOCK_SIZE];
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    for (int64_t frame = 0; frame < totalFrames; frame += BLOCK_SIZE) {
+        int n = (int)std::min((int64_t)BLOCK_SIZE, totalFrames - frame);
+        if (in.clockConnected) {
+            // Clock edges fall where the internal clock's beats would, the
+            // first one a beat after the start
+            for (int i = 0; i < n; i++) {
+                int64_t sample = frame + i;
+                int64_t beat = (int64_t)(sample / beatSamples);
+                int64_t sinceEdge = sample - (int64_t)std::ceil(beat * beatSamples);
+                clockBuffer[i] = (beat > 0 && sinceEdge >= 0 && sinceEdge < clockPulseSamples) ? 10.f : 0.f;
+            }
+        }
+        core->processBlock(in, blockIn, blockOut, n);
+        for (int i = 0; i < n; i++) {
+            for (int c = 0; c < CHANNELS; c++) {
+                interleaved[(size_t)i * CHANNELS + c] = planar[(size_t)c * BLOCK_SIZE + i];
+            }
+        }
+        writer.write(interleaved.data(), n);
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    delete core;
+
+    if (!writer.close()) {
+        std::fprintf(stderr, "Error writing %s\n", outputPath);
+        return false;
+    }
+    stats.frames = totalFrames;
+    stats.seconds = seconds;
+    return true;
+}
+
+// Engine sizes to choose from (tracks x steps x scenes)
+typedef bool (*RenderFunction)(const RenderConfig& config, const json_t* dataJ, const char* outputPath, RenderStats& stats);
+
+struct RenderModel {
+    const char* name;
+    RenderFunction render;
+};
+
+static const RenderModel MODELS[] = {
+    {"3x8x8", render<SequencerCore>},
+    {"4x16x16", render<SequencerCore4x16>},
+    {"8x64x32", render<SequencerCore8x64>}
+};
+static const int NUM_MODELS = 3;
+
+static void printRate(const char* name, const RenderStats& stats, float sampleRate) {
+    double audioSeconds = stats.frames / (double)sampleRate;
+    std::fprintf(stderr, "%s: %lld frames (%.1f s) in %.3f s, %.0fx realtime\n",
+        name, (long long)stats.frames, audioSeconds, stats.seconds, audioSeconds / std::max(stats.seconds, 1e-9));
+}
+
+// Loads one patch and renders it
+static bool renderFile(const RenderConfig& config, const RenderModel& model, const char* inputPath, const char* outputPath, RenderStats& stats) {
+    json_error_t error;
+    json_t* rootJ = json_load_file(inputPath, 0, &error);
+    if (!rootJ) {
+        std::fprintf(stderr, "%s:%d: %s\n", inputPath, error.line, error.text);
+        return false;
+    }
+    // Module and preset files keep the module state under "data"
+    const json_t* dataJ = json_object_get(rootJ, "data");
+    if (!dataJ)
+        dataJ = rootJ;
+
+    bool ok = model.render(config, dataJ, outputPath, stats);
+    json_decref(rootJ);
+    if (ok && !config.quiet)
+        printRate(outputPath, stats, config.sampleRate);
+    return ok;
+}
+
+// Work-stealing pool for batch renders. Jobs are dealt out round-robin;
+// each worker takes jobs from the back of its own queue and, once that
+// runs dry, steals from the front of the others', so a few slow patches
+// cannot leave cores idle while others still have a backlog.
+struct WorkStealingPool {
+    struct Queue {
+        std::mutex mutex;
+        std::deque<int> jobs;
+    };
+    std::vector<Queue> queues;
+
+    explicit WorkStealingPool(int numWorkers) : queues((size_t)numWorkers) {}
+
+    void add(int job, int index) {
+        queues[(size_t)index % queues.size()].jobs.push_back(job);
+    }
+
+    bool take(int worker, int& job) {
+        int n = (int)queues.size();
+        for (int k = 0; k < n; k++) {
+            Queue& queue = queues[(size_t)((worker + k) % n)];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.jobs.empty())
+                continue;
+            if (k == 0) {
+                job = queue.jobs.back();
+                queue.jobs.pop_back();
+            } else {
+                job = queue.jobs.front();
+                queue.jobs.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Runs work(worker, job) for every job, one thread per queue. No jobs
+    // are added while running, so a worker that finds every queue empty is
+    // done.
+    template <class Work>
+    void run(Work work) {
+        std::vector<std::thread> threads;
+        for (int w = 0; w < (int)queues.size(); w++) {
+            threads.push_back(std::thread([this, w, &work]() {
+                int job;
+                while (take(w, job))
+                    work(w, job);
+            }));
+        }
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+    }
+};
+
+static const char* formatExtension(OutputFormat format) {
+    switch (format) {
+        case FORMAT_RAW: return ".raw";
+        case FORMAT_WAV: return ".wav";
+        default: return ".csv";
+    }
+}
+
+static bool isPatchFile(const std::string& name) {
+    const char* suffixes[] = {".json", ".vcvm"};
+    for (const char* suffix : suffixes) {
+        size_t length = std::strlen(suffix);
+        if (name.size() > length && name.compare(name.size() - length, length, suffix) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Renders every patch file in config.inputPath into config.outputPath
+static int renderBatch(const RenderConfig& config, const RenderModel& model) {
+    DIR* dir = opendir(config.inputPath);
+    if (!dir) {
+        std::fprintf(stderr, "Cannot read directory %s\n", config.inputPath);
+        return 1;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(dir)) {
+        if (isPatchFile(entry->d_name))
+            names.push_back(entry->d_name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    if (names.empty()) {
+        std::fprintf(stderr, "No .json or .vcvm patches in %s\n", config.inputPath);
+        return 1;
+    }
+    mkdir(config.outputPath, 0777);
+
+    int numWorkers = config.jobs > 0 ? config.jobs : (int)std::thread::hardware_concurrency();
+    numWorkers = std::max(std::min(numWorkers, (int)names.size()), 1);
+    WorkStealingPool pool(numWorkers);
+    for (int i = 0; i < (int)names.size(); i++) {
+        pool.add(i, i);
+    }
+
+    // Per-worker totals, summed once all workers are done
+    std::vector<RenderStats> workerStats((size_t)numWorkers);
+    std::vector<int> workerFailures((size_t)numWorkers, 0);
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    pool.run([&](int worker, int job) {
+        const std::string& name = names[(size_t)job];
+        std::string inputPath = std::string(config.inputPath) + "/" + name;
+        std::string outputPath = std::string(config.outputPath) + "/" + name.substr(0, name.rfind('.')) + formatExtension(config.format);
+        RenderStats stats;
+        if (renderFile(config, model, inputPath.c_str(), outputPath.c_str(), stats))
+            workerStats[(size_t)worker].frames += stats.frames;
+        else
+            workerFailures[(size_t)worker]++;
+    });
+
+    RenderStats total;
+    total.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    int failures = 0;
+    for (int w = 0; w < numWorkers; w++) {
+        total.frames += workerStats[(size_t)w].frames;
+        failures += workerFailures[(size_t)w];
+    }
+    char name[64];
+    std::snprintf(name, sizeof(name), "%d patches on %d threads", (int)names.size() - failures, numWorkers);
+    printRate(name, total, config.sampleRate);
+    if (failures > 0) {
+        std::fprintf(stderr, "%d of %d patches failed\n", failures, (int)names.size());
+        return 1;
+    }
+    return 0;
+}
+
+static void printUsage(const char* argv0) {
+    std::printf("Usage: %s [options] PATCH.json OUTPUT\n", argv0);
+    std::printf("       %s [options] --batch PATCH_DIR OUTPUT_DIR\n", argv0);
+    std::printf("  --model M        engine size: 3x8x8 (default, the Rack module), 4x16x16 or 8x64x32\n");
+    std::printf("  --format F       csv, raw or wav (default from the OUTPUT extension, else csv)\n");
+    std::printf("  --rate HZ        sample rate (default 48000)\n");
+    std::printf("  --bpm BPM        tempo (default 120)\n");
+    std::printf("  --clock SRC      int: internal clock, ext: pulse train into the clock input (default int)\n");
+    std::printf("  --smoothing X    external clock smoothing, 0 to below 1 (default 0.5)\n");
+    std::printf("  --swing PCT      swing, 0-100 (default 0)\n");
+    std::printf("  --pw PCT         gate pulse width, 10-90 (default 50)\n");
+    std::printf("  --bars N         length in bars (default 4)\n");
+    std::printf("  --beats-per-bar N  (default 4)\n");
+    std::printf("  --start BAR      start position in bars after a reset (default 0)\n");
+    std::printf("  --scene N        scene to play, 0-based (default: the patch's current scene)\n");
+    std::printf("  --quiet          no per-file throughput report\n");
+    std::printf("  --batch          render every .json/.vcvm patch in PATCH_DIR to OUTPUT_DIR\n");
+    std::printf("  --jobs N         batch worker threads (default: one per core)\n");
+}
+
+static bool endsWith(const char* s, const char* suffix) {
+    size_t length = std::strlen(s);
+    size_t suffixLength = std::strlen(suffix);
+    return length >= suffixLength && !std::strcmp(s + length - suffixLength, suffix);
+}
+
+// Parses the command line, returns false on bad usage
+static bool parseArgs(int argc, char** argv, RenderConfig& config, const RenderModel*& model) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (!std::strcmp(arg, "--model") && hasValue) {
+            const char* name = argv[++i];
+            model = nullptr;
+            for (int m = 0; m < NUM_MODELS; m++) {
+                if (!std::strcmp(name, MODELS[m].name))
+                    model = &MODELS[m];
+            }
+            if (!model)
+                return false;
+        } else if (!std::strcmp(arg, "--format") && hasValue) {
+            const char* name = argv[++i];
+            config.formatGiven = true;
+            if (!std::strcmp(name, "csv"))
+                config.format = FORMAT_CSV;
+            else if (!std::strcmp(name, "raw"))
+                config.format = FORMAT_RAW;
+            else if (!std::strcmp(name, "wav"))
+                config.format = FORMAT_WAV;
+            else
+                return false;
+        } else if (!std::strcmp(arg, "--clock") && hasValue) {
+            const char* name = argv[++i];
+            if (!std::strcmp(name, "int"))
+                config.clock = CLOCK_INTERNAL;
+            else if (!std::strcmp(name, "ext"))
+                config.clock = CLOCK_EXTERNAL;
+            else
+                return false;
+        } else if (!std::strcmp(arg, "--rate") && hasValue) {
+            config.sampleRate = (float)std::atof(argv[++i]);
+        } else if (!std::strcmp(arg, "--bpm") && hasValue) {
+            config.bpm = (float)std::atof(argv[++i]);
+        } else if (!std::strcmp(arg, "--smoothing") && hasValue) {
+            config.clockSmoothing = (float)std::atof(argv[++i]);
+        } else if (!std::strcmp(arg, "--swing") && hasValue) {
+            config.swing = (float)std::atof(argv[++i]);
+        } else if (!std::strcmp(arg, "--pw") && hasValue) {
+            config.pulseWidth = (float)std::atof(argv[++i]);
+        } else if (!std::strcmp(arg, "--bars") && hasValue) {
+            config.bars = std::atof(argv[++i]);
+        } else if (!std::strcmp(arg, "--beats-per-bar") && hasValue) {
+            config.beatsPerBar = std::atoi(argv[++i]);
+        } else if (!std::strcmp(arg, "--start") && hasValue) {
+            config.startBar = std::atol(argv[++i]);
+        } else if (!std::strcmp(arg, "--scene") && hasValue) {
+            config.scene = std::atoi(argv[++i]);
+        } else if (!std::strcmp(arg, "--jobs") && hasValue) {
+            config.jobs = std::atoi(argv[++i]);
+        } else if (!std::strcmp(arg, "--quiet")) {
+            config.quiet = true;
+        } else if (!std::strcmp(arg, "--batch")) {
+            config.batch = true;
+        } else if (arg[0] == '-' && arg[1] == '-') {
+            return false;
+        } else if (!config.inputPath) {
+            config.inputPath = arg;
+        } else if (!config.outputPath) {
+            config.outputPath = arg;
+        } else {
+            return false;
+        }
+    }
+    if (!config.inputPath || !config.outputPath)
+        return false;
+    if (!config.formatGiven) {
+        if (endsWith(config.outputPath, ".wav"))
+            config.format = FORMAT_WAV;
+        else if (endsWith(config.outputPath, ".raw") || endsWith(config.outputPath, ".f32"))
+            config.format = FORMAT_RAW;
+    }
+    config.swing = std::max(std::min(config.swing, 100.f), 0.f);
+    config.pulseWidth = std::max(std::min(config.pulseWidth, 90.f), 10.f);
+    // At 1 the PLL would never correct its phase or tempo
+    return config.sampleRate > 0.f && config.bpm > 0.f && config.bars > 0.0
+        && config.clockSmoothing >= 0.f && config.clockSmoothing < 1.f
+        && config.beatsPerBar > 0 && config.startBar >= 0;
+}
+
+int main(int argc, char** argv) {
+    RenderConfig config;
+    const RenderModel* model = &MODELS[0];
+    if (!parseArgs(argc, argv, config, model)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    if (config.batch)
+        return renderBatch(config, *model);
+    RenderStats stats;
+    return renderFile(config, *model, config.inputPath, config.outputPath, stats) ? 0 : 1;
+}